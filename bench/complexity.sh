@@ -0,0 +1,109 @@
+#!/usr/bin/env bash
+#
+# Check that operations keep the complexity we expect of them.
+#
+#     bench/complexity.sh [--slack X] [CASE...]
+#
+# Each script in bench/complexity/ declares, on its first line, the largest
+# growth exponents it may show and the input sizes to try:
+#
+#     ;; complexity: time 2 allocs 1 bytes 2 sizes 500 1000 2000 4000
+#
+# "allocs" bounds the number of allocations and "bytes" the number of bytes
+# allocated, which grows faster when each allocation gets bigger. We
+# substitute every size for @N@, run the script (the best of three runs for
+# time), and fit the exponent k of each quantity ~ N^k by least squares on
+# a log-log scale. A case fails if a fitted exponent is more than X
+# (default 0.3) above the declared one. The exit status is 1 if any case
+# failed.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+. bench/lib.sh
+
+SLACK=0.3
+CASES=()
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --slack) SLACK="$2"; shift 2 ;;
+        -*)      sed -n '3,18s/^# \{0,1\}//p' "$0"; exit 2 ;;
+        *)       CASES+=("$1"); shift ;;
+    esac
+done
+
+if [ ${#CASES[@]} -eq 0 ]; then
+    for f in bench/complexity/*.nickel; do
+        CASES+=("$(basename "$f" .nickel)")
+    done
+fi
+
+./build.sh
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# Fit k in y = c * x^k to the "x y" pairs on stdin.
+fit() {
+    awk '{ x = log($1); y = log($2 > 0 ? $2 : 1)
+           sx += x; sy += y; sxx += x * x; sxy += x * y; n += 1 }
+         END { printf "%.2f", (n * sxy - sx * sy) / (n * sxx - sx * sx) }'
+}
+
+FAILED=0
+
+printf "%-16s %12s %12s %12s   %s\n" "case" "time" "allocs" "bytes" ""
+
+for c in "${CASES[@]}"; do
+    src="bench/complexity/$c.nickel"
+    if [ ! -f "$src" ]; then
+        echo "no such case: $c" >&2
+        exit 2
+    fi
+
+    spec=$(sed -n '1s/^;; complexity: //p' "$src")
+    max_time=$(echo "$spec"   | sed -n 's/.*time \([0-9.]*\).*/\1/p')
+    max_allocs=$(echo "$spec" | sed -n 's/.*allocs \([0-9.]*\).*/\1/p')
+    max_bytes=$(echo "$spec"  | sed -n 's/.*bytes \([0-9.]*\).*/\1/p')
+    sizes=$(echo "$spec"      | sed -n 's/.*sizes \(.*\)/\1/p')
+    if [ -z "$max_time" ] || [ -z "$max_allocs" ] || [ -z "$max_bytes" ] || [ -z "$sizes" ]; then
+        echo "$src: missing or malformed complexity line" >&2
+        exit 2
+    fi
+
+    : > "$TMP/time"
+    : > "$TMP/allocs"
+    : > "$TMP/bytes"
+    for n in $sizes; do
+        sed "s/@N@/$n/g" "$src" > "$TMP/prog.nickel"
+        best=
+        for run in 1 2 3; do
+            ./nickel --seed 42 --stats-json "$TMP/stats.json" "$TMP/prog.nickel" > /dev/null
+            t=$(stat eval-ns "$TMP/stats.json")
+            if [ -z "$best" ] || [ "$t" -lt "$best" ]; then best=$t; fi
+        done
+        echo "$n $best"                                     >> "$TMP/time"
+        echo "$n $(stat allocations "$TMP/stats.json")"     >> "$TMP/allocs"
+        echo "$n $(stat allocated-bytes "$TMP/stats.json")" >> "$TMP/bytes"
+    done
+
+    k_time=$(fit < "$TMP/time")
+    k_allocs=$(fit < "$TMP/allocs")
+    k_bytes=$(fit < "$TMP/bytes")
+
+    verdict=$(awk -v kt="$k_time" -v ka="$k_allocs" -v kb="$k_bytes" \
+                  -v mt="$max_time" -v ma="$max_allocs" -v mb="$max_bytes" -v s="$SLACK" 'BEGIN {
+        bad = ""
+        if (kt > mt + s) { bad = bad sprintf(" time exceeds O(n^%s)", mt) }
+        if (ka > ma + s) { bad = bad sprintf(" allocs exceed O(n^%s)", ma) }
+        if (kb > mb + s) { bad = bad sprintf(" bytes exceed O(n^%s)", mb) }
+        print bad == "" ? "ok" : "FAIL:" bad
+    }')
+    case "$verdict" in FAIL*) FAILED=1 ;; esac
+
+    printf "%-16s %12s %12s %12s   %s\n" "$c" "n^$k_time" "n^$k_allocs" "n^$k_bytes" "$verdict"
+done
+
+exit $FAILED
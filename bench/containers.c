@@ -0,0 +1,502 @@
+/*
+ * containers.c
+ *
+ * Microbenchmarks for the containers in src/array.c and src/hash_table.h,
+ * measured on their own, outside of the interpreter.
+ *
+ *     gcc -O3 -o bench/containers bench/containers.c && bench/containers
+ *
+ * For every case we report the time per operation and, when the kernel
+ * lets us open the hardware counter, the cache misses per operation. Hash
+ * table keys look like the names in real Nickel programs: short words
+ * joined with dashes, sometimes with a number at the end. Pass a substring
+ * as the only argument to run just the cases whose names contain it. Keys
+ * are hashed with the interpreter's string hash, so NICKEL_SIMD picks the
+ * hash here too.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "../src/simd.h"
+#include "../src/array.c"
+#include "../src/hash_table.h"
+
+
+
+/*** Measurement ***/
+
+static int         perf_fd = -1;
+static const char *filter;
+
+/* Keep the compiler from throwing away the work we are timing. */
+static volatile uint64_t sink;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void perf_init(void) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.config         = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled       = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+
+    perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+typedef struct {
+    uint64_t start_ns;
+    uint64_t start_misses;
+} Timer;
+
+static uint64_t perf_read(void) {
+    uint64_t count;
+
+    if (perf_fd < 0 || read(perf_fd, &count, sizeof(count)) != sizeof(count)) {
+        return 0;
+    }
+    return count;
+}
+
+static void timer_start(Timer *t) {
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    t->start_misses = perf_read();
+    t->start_ns     = now_ns();
+}
+
+static void timer_stop(Timer *t, const char *name, uint64_t size, double load, uint64_t ops) {
+    uint64_t ns;
+    uint64_t misses;
+
+    ns     = now_ns() - t->start_ns;
+    misses = perf_read() - t->start_misses;
+    if (perf_fd >= 0) { ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0); }
+
+    printf("%-24s %9llu", name, (unsigned long long)size);
+    if (load >= 0) { printf(" %6.2f", load); } else { printf(" %6s", "-"); }
+    printf(" %10.2f", (double)ns / ops);
+    if (perf_fd >= 0) { printf(" %12.3f", (double)misses / ops); } else { printf(" %12s", "-"); }
+    printf("\n");
+}
+
+static int want(const char *name) {
+    return filter == NULL || strstr(name, filter) != NULL;
+}
+
+/* Repeat a case so that each measurement covers at least this many
+   operations. */
+#define MIN_OPS (1 << 20)
+
+static uint64_t reps_for(uint64_t n) {
+    return n >= MIN_OPS ? 1 : (MIN_OPS + n - 1) / n;
+}
+
+
+
+/*** Keys ***/
+
+static const char *words[] = {
+    "list", "len", "car", "cdr", "merge", "sort", "split", "rec", "helper",
+    "fib", "rand", "build", "string", "rep", "elem", "print", "parts", "map",
+    "get", "put", "count", "loop", "step", "acc", "make", "tree", "node",
+    "left", "right", "sum", "max", "min", "fold", "filter", "reverse", "take",
+};
+
+#define N_WORDS (sizeof(words) / sizeof(words[0]))
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/* Make `n` distinct symbol-like names, e.g. "merge-sort" or "split-rec-12".
+   `salt` keeps the names of different sets apart. */
+static char **make_keys(uint64_t n, int salt) {
+    char     **keys;
+    char       buff[64];
+    uint64_t   i;
+    int        len;
+    int        parts;
+    int        p;
+
+    keys = malloc(n * sizeof(*keys));
+    for (i = 0; i < n; i += 1) {
+        len   = 0;
+        parts = 1 + rng() % 3;
+        for (p = 0; p < parts; p += 1) {
+            len += snprintf(buff + len, sizeof(buff) - len, "%s%s",
+                            p ? "-" : "", words[rng() % N_WORDS]);
+        }
+        /* The suffix makes the name unique. */
+        snprintf(buff + len, sizeof(buff) - len, salt ? "-%llu!" : "-%llu",
+                 (unsigned long long)i);
+        keys[i] = strdup(buff);
+    }
+
+    return keys;
+}
+
+static void free_keys(char **keys, uint64_t n) {
+    uint64_t i;
+
+    for (i = 0; i < n; i += 1) { free(keys[i]); }
+    free(keys);
+}
+
+static void shuffle(char **keys, uint64_t n) {
+    uint64_t  i;
+    uint64_t  j;
+    char     *tmp;
+
+    for (i = n - 1; i > 0; i -= 1) {
+        j       = rng() % (i + 1);
+        tmp     = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+}
+
+
+
+/*** Arrays ***/
+
+/* The same size as the interpreter's Node. */
+typedef struct {
+    array_t   children;
+    int       kind;
+    unsigned  loc;
+} NodeLike;
+
+use_array(NodeLike);
+
+static void bench_push_int(uint64_t n) {
+    Timer    t;
+    uint64_t r, reps, i;
+    array_t  a;
+    int      x;
+
+    if (!want("array push int")) { return; }
+
+    reps = reps_for(n);
+    timer_start(&t);
+    for (r = 0; r < reps; r += 1) {
+        a = array_make(int);
+        for (i = 0; i < n; i += 1) {
+            x = i;
+            array_push(a, x);
+        }
+        sink += array_len(a);
+        array_free(a);
+    }
+    timer_stop(&t, "array push int", n, -1, reps * n);
+}
+
+/* Pushes through array_push(), or with typed set, through the use_array()
+   version that knows the element size. */
+static void bench_push_node(uint64_t n, int presized, int typed) {
+    Timer       t;
+    uint64_t    r, reps, i;
+    array_t     a;
+    NodeLike    x;
+    const char *name;
+
+    name = typed    ? "array push node typed"
+         : presized ? "array push node presized"
+         :            "array push node";
+    if (!want(name)) { return; }
+
+    memset(&x, 0, sizeof(x));
+
+    reps = reps_for(n);
+    timer_start(&t);
+    for (r = 0; r < reps; r += 1) {
+        a = presized ? array_make_with_cap(NodeLike, n) : array_make(NodeLike);
+        if (typed) {
+            for (i = 0; i < n; i += 1) {
+                x.kind = i;
+                array_call(NodeLike, push)(&a, &x);
+            }
+        } else {
+            for (i = 0; i < n; i += 1) {
+                x.kind = i;
+                array_push(a, x);
+            }
+        }
+        sink += array_len(a);
+        array_free(a);
+    }
+    timer_stop(&t, name, n, -1, reps * n);
+}
+
+/* Building a string a few characters at a time, like fmt does. */
+static void bench_push_n(uint64_t n) {
+    Timer     t;
+    uint64_t  r, reps, i;
+    array_t   a;
+    char      chunk[] = "abcdefghijklmno";
+
+    if (!want("array push_n 16 chars")) { return; }
+
+    reps = reps_for(n);
+    timer_start(&t);
+    for (r = 0; r < reps; r += 1) {
+        a = array_make(char);
+        for (i = 0; i < n; i += 1) {
+            array_push_n(a, chunk, 16);
+        }
+        sink += array_len(a);
+        array_free(a);
+    }
+    timer_stop(&t, "array push_n 16 chars", n, -1, reps * n);
+}
+
+static void bench_insert(uint64_t n, int where) {
+    Timer       t;
+    uint64_t    r, reps, i;
+    array_t     a;
+    NodeLike    x;
+    const char *name;
+
+    name = where == 0 ? "array insert front" : "array insert middle";
+    if (!want(name)) { return; }
+
+    memset(&x, 0, sizeof(x));
+
+    reps = reps_for(n);
+    timer_start(&t);
+    for (r = 0; r < reps; r += 1) {
+        a = array_make(NodeLike);
+        for (i = 0; i < n; i += 1) {
+            array_insert(a, where == 0 ? 0 : array_len(a) / 2, x);
+        }
+        sink += array_len(a);
+        array_free(a);
+    }
+    timer_stop(&t, name, n, -1, reps * n);
+}
+
+static void bench_delete(uint64_t n, int where) {
+    Timer       t;
+    uint64_t    r, reps, i;
+    array_t     a;
+    NodeLike    x;
+    uint64_t    ns;
+    uint64_t    start;
+    const char *name;
+
+    name = where == 0 ? "array delete front" : "array pop";
+    if (!want(name)) { return; }
+
+    memset(&x, 0, sizeof(x));
+
+    /* Only the deletes are timed, so we keep our own clock and fold the
+       total into a Timer at the end. */
+    reps = reps_for(n);
+    ns   = 0;
+    timer_start(&t);
+    for (r = 0; r < reps; r += 1) {
+        a = array_make_with_cap(NodeLike, n);
+        for (i = 0; i < n; i += 1) { array_push(a, x); }
+
+        start = now_ns();
+        for (i = 0; i < n; i += 1) {
+            if (where == 0) { array_delete(a, 0); } else { array_pop(a); }
+        }
+        ns += now_ns() - start;
+
+        array_free(a);
+    }
+    t.start_ns = now_ns() - ns;
+    timer_stop(&t, name, n, -1, reps * n);
+}
+
+
+
+/*** Hash tables ***/
+
+/* The interpreter's symbol table hash: CRC32C where the CPU has it. */
+static uint64_t str_hash(const char *s) { return simd_str_hash(s); }
+static int str_equ(const char *a, const char *b) { return strcmp(a, b) == 0; }
+typedef const char *str_t;
+
+use_hash_table(str_t, int);
+
+typedef hash_table(str_t, int) table_t;
+
+static table_t table_fill(char **keys, uint64_t n) {
+    table_t  t;
+    uint64_t i;
+
+    t = hash_table_make_e(str_t, int, str_hash, str_equ);
+    for (i = 0; i < n; i += 1) {
+        hash_table_insert(t, keys[i], i);
+    }
+
+    return t;
+}
+
+static double table_load(table_t t) {
+    return (double)hash_table_len(t) / t->_cap;
+}
+
+/* The slowest single insertion while filling a table with n keys: where a
+   growing table pays for moving its entries. */
+static void bench_hash_worst(char **keys, uint64_t n, int incremental) {
+    table_t   t;
+    uint64_t  i, start, ns, worst;
+    const char *name;
+
+    name = incremental ? "hash insert worst incr" : "hash insert worst";
+    if (!want(name)) { return; }
+
+    t = incremental ? hash_table_make_incremental(str_t, int, str_hash, str_equ)
+                    : hash_table_make_e(str_t, int, str_hash, str_equ);
+
+    worst = 0;
+    for (i = 0; i < n; i += 1) {
+        start = now_ns();
+        hash_table_insert(t, keys[i], i);
+        ns    = now_ns() - start;
+        if (ns > worst) { worst = ns; }
+    }
+
+    printf("%-24s %9llu %6.2f %10.2f %12s\n", name, (unsigned long long)n,
+           table_load(t), (double)worst, "-");
+
+    hash_table_free(t);
+}
+
+static void bench_hash(uint64_t n) {
+    char     **keys;
+    char     **misses;
+    table_t    table;
+    Timer      t;
+    uint64_t   r, reps, i;
+    double     load;
+    int       *val;
+
+    keys   = make_keys(n, 0);
+    misses = make_keys(n, 1);
+    reps   = reps_for(n);
+
+    if (want("hash insert")) {
+        timer_start(&t);
+        for (r = 0; r < reps; r += 1) {
+            table = table_fill(keys, n);
+            load  = table_load(table);
+            hash_table_free(table);
+        }
+        timer_stop(&t, "hash insert", n, load, reps * n);
+    }
+
+    bench_hash_worst(keys, n, 0);
+    bench_hash_worst(keys, n, 1);
+
+    table = table_fill(keys, n);
+    load  = table_load(table);
+
+    /* Look the keys up in a different order than they went in. */
+    shuffle(keys, n);
+
+    if (want("hash lookup hit")) {
+        timer_start(&t);
+        for (r = 0; r < reps; r += 1) {
+            for (i = 0; i < n; i += 1) {
+                val   = hash_table_get_val(table, keys[i]);
+                sink += *val;
+            }
+        }
+        timer_stop(&t, "hash lookup hit", n, load, reps * n);
+    }
+
+    if (want("hash lookup miss")) {
+        timer_start(&t);
+        for (r = 0; r < reps; r += 1) {
+            for (i = 0; i < n; i += 1) {
+                sink += hash_table_get_val(table, misses[i]) != NULL;
+            }
+        }
+        timer_stop(&t, "hash lookup miss", n, load, reps * n);
+    }
+
+    if (want("hash delete")) {
+        timer_start(&t);
+        for (i = 0; i < n; i += 1) {
+            sink += hash_table_delete(table, keys[i]);
+        }
+        timer_stop(&t, "hash delete", n, load, n);
+    }
+
+    hash_table_free(table);
+    free_keys(keys, n);
+    free_keys(misses, n);
+}
+
+
+
+int main(int argc, char **argv) {
+    /* Each pair fills the same capacity to just over 7/16, right after it
+       doubled, and to 7/8, right before it would double again: the lowest
+       and highest load factors the table runs at. */
+    static const uint64_t hash_sizes[] = {
+        897, 1792, 7169, 14336, 114689, 229376,
+    };
+    static const uint64_t array_sizes[] = { 16, 1024, 65536, 1 << 20 };
+    unsigned i;
+    uint64_t n;
+
+    if (argc > 1) { filter = argv[1]; }
+
+    simd_init();
+    perf_init();
+
+    printf("%-24s %9s %6s %10s %12s\n", "case", "size", "load", "ns/op",
+           perf_fd >= 0 ? "misses/op" : "(no counter)");
+
+    for (i = 0; i < sizeof(array_sizes) / sizeof(array_sizes[0]); i += 1) {
+        bench_push_int(array_sizes[i]);
+        bench_push_node(array_sizes[i], 0, 0);
+        bench_push_node(array_sizes[i], 1, 0);
+        bench_push_node(array_sizes[i], 0, 1);
+        bench_push_n(array_sizes[i]);
+        bench_delete(array_sizes[i], 1);
+        /* These are quadratic; keep them to sizes that finish. */
+        if (array_sizes[i] <= 65536) {
+            n = array_sizes[i] < 4096 ? array_sizes[i] : 4096;
+            bench_insert(n, 0);
+            bench_insert(n, 1);
+            bench_delete(n, 0);
+        }
+    }
+
+    for (i = 0; i < sizeof(hash_sizes) / sizeof(hash_sizes[0]); i += 1) {
+        bench_hash(hash_sizes[i]);
+    }
+
+    return 0;
+}
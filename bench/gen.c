@@ -0,0 +1,103 @@
+/*
+ * gen.c
+ *
+ * Writes synthetic Nickel programs of a given size to stdout, for testing
+ * how the interpreter scales:
+ *
+ *     gcc -O2 -o bench/gen bench/gen.c
+ *     bench/gen SHAPE N > program.nickel
+ *
+ * Shapes:
+ *     forms N      N small top-level forms
+ *     list N       one literal list of N elements
+ *     nest N       an expression nested N deep
+ *     defs N       N function definitions, each called once
+ *     strings N    N string literals without escapes
+ *     escapes N    N string literals full of escapes
+ *
+ * Every program prints a single small value at the end, so its output
+ * doesn't grow with N.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+static void gen_forms(long n) {
+    long i;
+
+    for (i = 0; i < n; i += 1) {
+        printf("[+ %ld [* %ld 3]]\n", i, i % 97);
+    }
+    printf("[print %ld]\n", n);
+}
+
+static void gen_list(long n) {
+    long i;
+
+    printf("[print [len [list");
+    for (i = 0; i < n; i += 1) {
+        printf(i % 16 ? " %ld" : "\n    %ld", i);
+    }
+    printf("]]]\n");
+}
+
+static void gen_nest(long n) {
+    long i;
+
+    printf("[print ");
+    for (i = 0; i < n; i += 1) { printf("[+ 1 "); }
+    printf("0");
+    for (i = 0; i < n; i += 1) { printf("]"); }
+    printf("]\n");
+}
+
+static void gen_defs(long n) {
+    long i;
+
+    for (i = 0; i < n; i += 1) {
+        printf("[define fn-%ld [+ :1 %ld]]\n", i, i);
+    }
+    for (i = 0; i < n; i += 1) {
+        printf("[fn-%ld %ld]\n", i, i);
+    }
+    printf("[print %ld]\n", n);
+}
+
+static void gen_strings(long n, int escapes) {
+    long i;
+
+    for (i = 0; i < n; i += 1) {
+        if (escapes) {
+            printf("\"line %ld\\n\\ttab \\\"quoted\\\" back\\\\slash\\n\"\n", i);
+        } else {
+            printf("\"line %ld, plain text of about the same length..\"\n", i);
+        }
+    }
+    printf("[print %ld]\n", n);
+}
+
+int main(int argc, char **argv) {
+    const char *shape;
+    long        n;
+
+    if (argc != 3 || (n = atol(argv[2])) < 0) {
+        fprintf(stderr, "usage: %s forms|list|nest|defs|strings|escapes N\n", argv[0]);
+        return 1;
+    }
+
+    shape = argv[1];
+
+    if      (strcmp(shape, "forms")   == 0) { gen_forms(n);      }
+    else if (strcmp(shape, "list")    == 0) { gen_list(n);       }
+    else if (strcmp(shape, "nest")    == 0) { gen_nest(n);       }
+    else if (strcmp(shape, "defs")    == 0) { gen_defs(n);       }
+    else if (strcmp(shape, "strings") == 0) { gen_strings(n, 0); }
+    else if (strcmp(shape, "escapes") == 0) { gen_strings(n, 1); }
+    else {
+        fprintf(stderr, "unknown shape '%s'\n", shape);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,9 @@
+# Helpers shared by the scripts in bench/. Source it from the top of the
+# repository:
+#
+#     . bench/lib.sh
+
+# Pull a number out of a --stats-json file.
+stat() {
+    sed -n "s/^ *\"$1\": \([0-9]*\),\{0,1\}$/\1/p" "$2"
+}
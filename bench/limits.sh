@@ -0,0 +1,49 @@
+#!/usr/bin/env bash
+#
+# Check that the resource limits stop a program cleanly when combined with
+# the flags that write reports at exit.
+#
+#     bench/limits.sh
+#
+# Each limit is run together with each report flag on a program that goes
+# over it. The run must print the limit's error exactly once, and the
+# report must still be written. The exit status is 1 if any run failed.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+./build.sh
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+LIMITS=("--max-heap 64K" "--max-steps 100")
+REPORTS=("--profile --profile-json $TMP/report"
+         "--alloc-stats"
+         "--heap-census"
+         "--stats-json $TMP/report"
+         "--line-profile --line-profile-out $TMP/report")
+
+FAILED=0
+
+for limit in "${LIMITS[@]}"; do
+    for report in "${REPORTS[@]}"; do
+        rm -f "$TMP/report"
+        # Going over a limit is an error, so the exit status is not 0.
+        ./nickel --seed 42 $limit $report examples/lists.nickel > "$TMP/out" 2>&1 || true
+
+        errors=$(grep -c "Nickel: error:" "$TMP/out" || true)
+        status=ok
+        if [ "$errors" -ne 1 ]; then
+            status="FAILED ($errors errors)"
+        elif [[ "$report" == *"$TMP/report"* ]] && [ ! -s "$TMP/report" ]; then
+            status="FAILED (no report)"
+        fi
+
+        printf "%-18s %-14s %s\n" "$limit" "${report%% *}" "$status"
+        [ "$status" = ok ] || FAILED=1
+    done
+done
+
+exit $FAILED
@@ -0,0 +1,128 @@
+#!/usr/bin/env bash
+#
+# Build nickel and run the workloads in this directory.
+#
+#     bench/run.sh [-n RUNS] [--build MODE] [--save FILE] [--compare FILE] [--threshold PCT] [WORKLOAD...]
+#
+# Each workload is run RUNS times (default 5) with a fixed seed. We report
+# the median wall time, the largest max RSS and the number of allocations.
+# --save writes the results as JSON, to be used as a baseline later.
+# --compare reads such a baseline and flags every workload whose time or
+# RSS grew by more than PCT percent (default 10), or that allocates more.
+# The exit status is 1 if anything regressed. --build picks the build.sh
+# mode to benchmark, e.g. pgo.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+. bench/lib.sh
+
+RUNS=5
+SEED=42
+THRESHOLD=10
+BUILD=
+SAVE=
+COMPARE=
+WORKLOADS=()
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        -n)          RUNS="$2";      shift 2 ;;
+        --build)     BUILD="$2";     shift 2 ;;
+        --save)      SAVE="$2";      shift 2 ;;
+        --compare)   COMPARE="$2";   shift 2 ;;
+        --threshold) THRESHOLD="$2"; shift 2 ;;
+        -*)          sed -n '3,13s/^# \{0,1\}//p' "$0"; exit 2 ;;
+        *)           WORKLOADS+=("$1"); shift ;;
+    esac
+done
+
+if [ ${#WORKLOADS[@]} -eq 0 ]; then
+    for f in bench/*.nickel; do
+        WORKLOADS+=("$(basename "$f" .nickel)")
+    done
+fi
+
+./build.sh $BUILD
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# Print "ms rss allocs" for workload $1 in baseline $2, if it's there.
+baseline() {
+    sed -n "s/^ *\"$1\": { \"median_ms\": \([0-9.]*\), \"max_rss_kb\": \([0-9]*\), \"allocations\": \([0-9]*\) },\{0,1\}$/\1 \2 \3/p" "$2"
+}
+
+REGRESSED=0
+RESULTS=()
+
+printf "%-16s %12s %12s %14s" "workload" "median ms" "max RSS KB" "allocations"
+[ -n "$COMPARE" ] && printf "   %8s %8s %8s" "time" "RSS" "allocs"
+printf "\n"
+
+for w in "${WORKLOADS[@]}"; do
+    src="bench/$w.nickel"
+    if [ ! -f "$src" ]; then
+        echo "no such workload: $w" >&2
+        exit 2
+    fi
+
+    times=()
+    rss=0
+    allocs=0
+    for ((i = 0; i < RUNS; i++)); do
+        start=$(date +%s%N)
+        ./nickel --seed "$SEED" --stats-json "$TMP/stats.json" "$src" > /dev/null
+        end=$(date +%s%N)
+        times+=($(( (end - start) / 1000 )))
+
+        r=$(stat peak-rss-kb "$TMP/stats.json")
+        [ "$r" -gt "$rss" ] && rss=$r
+        allocs=$(stat allocations "$TMP/stats.json")
+    done
+
+    median_us=$(printf "%s\n" "${times[@]}" | sort -n | awk '{ t[NR] = $1 } END { print (NR % 2) ? t[(NR + 1) / 2] : (t[NR / 2] + t[NR / 2 + 1]) / 2 }')
+    ms=$(awk -v us="$median_us" 'BEGIN { printf "%.1f", us / 1000 }')
+
+    printf "%-16s %12s %12s %14s" "$w" "$ms" "$rss" "$allocs"
+
+    if [ -n "$COMPARE" ]; then
+        read -r b_ms b_rss b_allocs <<< "$(baseline "$w" "$COMPARE")"
+        if [ -z "$b_ms" ]; then
+            printf "   (not in baseline)"
+        else
+            flags=$(awk -v ms="$ms" -v rss="$rss" -v allocs="$allocs" \
+                        -v b_ms="$b_ms" -v b_rss="$b_rss" -v b_allocs="$b_allocs" -v t="$THRESHOLD" '
+                function pct(new, old) { return old > 0 ? 100 * (new - old) / old : 0 }
+                BEGIN {
+                    printf "   %+7.1f%% %+7.1f%% %+7.1f%%", pct(ms, b_ms), pct(rss, b_rss), pct(allocs, b_allocs)
+                    if (pct(ms, b_ms) > t || pct(rss, b_rss) > t || allocs > b_allocs) {
+                        printf "   REGRESSION"
+                    }
+                }')
+            printf "%s" "$flags"
+            case "$flags" in *REGRESSION*) REGRESSED=1 ;; esac
+        fi
+    fi
+    printf "\n"
+
+    RESULTS+=("  \"$w\": { \"median_ms\": $ms, \"max_rss_kb\": $rss, \"allocations\": $allocs }")
+done
+
+if [ -n "$SAVE" ]; then
+    {
+        echo "{"
+        for ((i = 0; i < ${#RESULTS[@]}; i++)); do
+            if [ $i -lt $((${#RESULTS[@]} - 1)) ]; then
+                echo "${RESULTS[$i]},"
+            else
+                echo "${RESULTS[$i]}"
+            fi
+        done
+        echo "}"
+    } > "$SAVE"
+    echo "saved results to $SAVE"
+fi
+
+exit $REGRESSED
@@ -0,0 +1,67 @@
+#!/usr/bin/env bash
+#
+# Measure how parsing and evaluation scale with the size of the program.
+#
+#     bench/scale.sh [--tsv DIR] [SHAPE...]
+#
+# For each shape that bench/gen.c knows about (default: all of them) we
+# generate programs of doubling size and run them with --stats-json. We
+# report parse throughput in MB/s and evaluation time per element, which
+# should stay flat when the interpreter scales linearly. --tsv writes one
+# SHAPE.tsv per shape to DIR, ready to plot.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+. bench/lib.sh
+
+TSV=
+SHAPES=()
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --tsv) TSV="$2"; shift 2 ;;
+        -*)    sed -n '3,11s/^# \{0,1\}//p' "$0"; exit 2 ;;
+        *)     SHAPES+=("$1"); shift ;;
+    esac
+done
+
+[ ${#SHAPES[@]} -eq 0 ] && SHAPES=(forms list nest defs strings escapes)
+[ -n "$TSV" ] && mkdir -p "$TSV"
+
+./build.sh
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+gcc -O2 -o "$TMP/gen" bench/gen.c
+
+# The sizes to try for each shape. Nesting is limited by the C stack.
+sizes() {
+    case "$1" in
+        nest) echo 250 500 1000 2000 4000 8000 ;;
+        *)    echo 1000 2000 4000 8000 16000 32000 64000 128000 ;;
+    esac
+}
+
+for shape in "${SHAPES[@]}"; do
+    echo "== $shape"
+    printf "%10s %12s %10s %10s %10s %12s\n" "N" "bytes" "parse ms" "MB/s" "eval ms" "eval ns/N"
+    [ -n "$TSV" ] && printf "n\tbytes\tparse_ns\teval_ns\n" > "$TSV/$shape.tsv"
+
+    for n in $(sizes "$shape"); do
+        "$TMP/gen" "$shape" "$n" > "$TMP/prog.nickel"
+        ./nickel --stats-json "$TMP/stats.json" "$TMP/prog.nickel" > /dev/null
+
+        bytes=$(stat source-bytes "$TMP/stats.json")
+        parse=$(stat parse-ns "$TMP/stats.json")
+        eval=$(stat eval-ns "$TMP/stats.json")
+
+        awk -v n="$n" -v b="$bytes" -v p="$parse" -v e="$eval" 'BEGIN {
+            printf "%10d %12d %10.2f %10.1f %10.2f %12.1f\n",
+                   n, b, p / 1e6, p ? (b / 1e6) / (p / 1e9) : 0, e / 1e6, e / n
+        }'
+        [ -n "$TSV" ] && printf "%s\t%s\t%s\t%s\n" "$n" "$bytes" "$parse" "$eval" >> "$TSV/$shape.tsv"
+    done
+done
@@ -1,3 +1,46 @@
 #!/usr/bin/env bash
+#
+#     ./build.sh            a portable -O3 build
+#     ./build.sh pgo        a profile-guided, link-time optimized build
+#     ./build.sh pgo-native the same, tuned for this machine (-march=native)
+#
+# The optimized builds first compile an instrumented binary and train it on
+# the workloads in bench/ and the examples, then rebuild with the profile
+# and -flto. They write the result to ./nickel and keep a portable build
+# alongside as ./nickel-portable.
 
-gcc -o nickel src/nickel.c -O3
+set -e
+
+cd "$(dirname "$0")"
+
+CC=${CC:-gcc}
+MODE=${1:-portable}
+
+case "$MODE" in
+    portable)
+        $CC -o nickel src/nickel.c -O3
+        exit 0
+        ;;
+    pgo)        ARCH= ;;
+    pgo-native) ARCH=-march=native ;;
+    *)
+        sed -n '3,5s/^# \{0,1\}//p' "$0"
+        exit 2
+        ;;
+esac
+
+PROFILE_DIR=$(mktemp -d)
+trap 'rm -rf "$PROFILE_DIR" nickel-instrumented' EXIT
+
+$CC -o nickel-portable src/nickel.c -O3
+
+$CC -o nickel-instrumented src/nickel.c -O3 $ARCH \
+    -fprofile-generate -fprofile-update=atomic -fprofile-dir="$PROFILE_DIR"
+
+for f in bench/*.nickel examples/*.nickel; do
+    ./nickel-instrumented --seed 42 "$f" > /dev/null
+done
+
+$CC -o nickel src/nickel.c -O3 $ARCH -flto=auto \
+    -fprofile-use -fprofile-partial-training -fprofile-dir="$PROFILE_DIR" \
+    -Wno-missing-profile
@@ -5,6 +5,18 @@
 #define likely(x)   (__builtin_expect(!!(x), 1))
 #define unlikely(x) (__builtin_expect(!!(x), 0))
 
+/* An includer may route array storage through its own allocator by defining
+ * these before including this file. */
+#ifndef ARRAY_MALLOC
+#define ARRAY_MALLOC(array, size) (malloc((size)))
+#endif
+#ifndef ARRAY_REALLOC
+#define ARRAY_REALLOC(array, ptr, size) (realloc((ptr), (size)))
+#endif
+#ifndef ARRAY_FREE
+#define ARRAY_FREE(array, ptr) (free((ptr)))
+#endif
+
 static unsigned long long next_power_of_2(unsigned long long x) {
     if (x == 0) {
         return 2;
@@ -25,89 +37,131 @@ static unsigned long long next_power_of_2(unsigned long long x) {
 array_t _array_make(int elem_size) {
     array_t a;
 
+    assert(elem_size <= ARRAY_MAX_ELEM_SIZE && "array element too big");
+
     a.data        = NULL;
     a.elem_size   = elem_size;
     a.used        = 0;
     a.capacity    = ARRAY_DEFAULT_CAP;
     a.should_free = 1;
+    a.tag         = 0;
 
     return a;
 }
 
-array_t _array_make_with_cap(int elem_size, int initial_cap) {
+array_t _array_make_with_cap(int elem_size, uint64_t initial_cap) {
     array_t a;
 
+    assert(elem_size <= ARRAY_MAX_ELEM_SIZE && "array element too big");
+    assert(initial_cap <= ARRAY_MAX_CAP && "array too big");
+
     a.data        = NULL;
     a.elem_size   = elem_size;
     a.used        = 0;
     a.capacity    = initial_cap;
     a.should_free = 1;
+    a.tag         = 0;
+
+    return a;
+}
+
+array_t _array_make_tagged(int elem_size, int tag) {
+    array_t a;
+
+    assert(tag <= ARRAY_MAX_TAG && "array tag too big");
+
+    a     = _array_make(elem_size);
+    a.tag = tag;
 
     return a;
 }
 
 void _array_free(array_t *array) {
     if (array->data && array->should_free) {
-        free(array->data);
+        ARRAY_FREE(array, array->data);
     }
     memset(array, 0, sizeof(*array));
 }
 
+/* Storage of at least this many bytes that we own is grown with realloc,
+ * which can often extend it where it is and, for buffers this big, remaps
+ * the pages instead of copying them. Smaller storage is cheaper to copy
+ * into a fresh malloc, which has fast paths that realloc doesn't use. */
+#ifndef ARRAY_REALLOC_MIN
+#define ARRAY_REALLOC_MIN (64 * 1024)
+#endif
+
+/* Move the data into storage for `capacity` elements. */
+static void array_resize_storage(array_t *array) {
+    void     *data_save;
+    uint64_t  bytes;
+
+    bytes = array->capacity * ARRAY_ELEM_SIZE(*array);
+
+    if (array->should_free && bytes >= ARRAY_REALLOC_MIN) {
+        array->data = ARRAY_REALLOC(array, array->data, bytes);
+    } else {
+        data_save   = array->data;
+        array->data = ARRAY_MALLOC(array, bytes);
+        assert(array->data != NULL && "out of memory");
+        memcpy(array->data, data_save, array->used * ARRAY_ELEM_SIZE(*array));
+        if (array->should_free) {
+            ARRAY_FREE(array, data_save);
+        }
+    }
+
+    assert(array->data != NULL && "out of memory");
+
+    array->should_free = 1;
+}
+
+static uint64_t array_next_cap(uint64_t cap) {
+    cap = next_power_of_2(cap);
+
+    assert(cap <= ARRAY_MAX_CAP && "array too big");
+
+    return cap;
+}
+
 void _array_grow_if_needed(array_t *array) {
-    void *data_save;
-    int   grow;
+    int grow;
 
     if (!array->data) {
-        array->data        = malloc(array->capacity * array->elem_size);
+        array->data        = ARRAY_MALLOC(array, array->capacity * ARRAY_ELEM_SIZE(*array));
         array->should_free = 1;
+        assert(array->data != NULL && "out of memory");
     } else {
         grow = 0;
 
         while (array->used >= array->capacity) {
-            array->capacity = next_power_of_2(array->capacity + 1);
+            array->capacity = array_next_cap(array->capacity + 1);
             grow = 1;
         }
 
-        if (grow) {
-            data_save   = array->data;
-            array->data = malloc(array->capacity * array->elem_size);
-            memcpy(array->data, data_save, array->used * array->elem_size);
-            if (array->should_free) {
-                free(data_save);
-            }
-            array->should_free = 1;
-        }
+        if (grow) { array_resize_storage(array); }
     }
 }
 
-void _array_grow_if_needed_to(array_t *array, int new_cap) {
-    void *data_save;
-    int   grow;
+void _array_grow_if_needed_to(array_t *array, uint64_t new_cap) {
+    int grow;
 
     grow = 0;
     if (new_cap > array->capacity) {
         grow = 1;
-        array->capacity = next_power_of_2(new_cap);
+        array->capacity = array_next_cap(new_cap);
     }
 
     if (!array->data) {
-        array->data        = malloc(array->capacity * array->elem_size);
+        array->data        = ARRAY_MALLOC(array, array->capacity * ARRAY_ELEM_SIZE(*array));
         array->should_free = 1;
+        assert(array->data != NULL && "out of memory");
     } else {
         while (array->used >= array->capacity) {
-            array->capacity = next_power_of_2(array->capacity + 1);
+            array->capacity = array_next_cap(array->capacity + 1);
             grow = 1;
         }
 
-        if (grow) {
-            data_save   = array->data;
-            array->data = malloc(array->capacity * array->elem_size);
-            memcpy(array->data, data_save, array->used * array->elem_size);
-            if (array->should_free) {
-                free(data_save);
-            }
-            array->should_free = 1;
-        }
+        if (grow) { array_resize_storage(array); }
     }
 }
 
@@ -115,7 +169,7 @@ void * _array_next_elem(array_t *array) {
     void *elem_slot;
 
     _array_grow_if_needed(array);
-    elem_slot = array->data + (array->elem_size * array->used++);
+    elem_slot = array->data + (ARRAY_ELEM_SIZE(*array) * array->used++);
     return elem_slot;
 }
 
@@ -128,22 +182,22 @@ void * _array_push(array_t *array, void *elem) {
     return elem_slot;
 }
 
-void * _array_push_n(array_t *array, void *elems, int n) {
+void * _array_push_n(array_t *array, void *elems, uint64_t n) {
     void *elem_slot;
 
     if (unlikely(n == 0))    { return NULL; }
 
     _array_grow_if_needed_to(array, array->used + n);
 
-    elem_slot    = array->data + (array->elem_size * array->used);
+    elem_slot    = array->data + (ARRAY_ELEM_SIZE(*array) * array->used);
     array->used += n;
 
-    memcpy(elem_slot, elems, n * array->elem_size);
+    memcpy(elem_slot, elems, n * ARRAY_ELEM_SIZE(*array));
 
     return elem_slot;
 }
 
-void * _array_insert(array_t *array, int idx, void *elem) {
+void * _array_insert(array_t *array, uint64_t idx, void *elem) {
     void *elem_slot;
 
     if (idx == array->used) {
@@ -154,11 +208,11 @@ void * _array_insert(array_t *array, int idx, void *elem) {
 
     _array_grow_if_needed(array);
 
-    elem_slot = array->data + (array->elem_size * idx);
+    elem_slot = array->data + (ARRAY_ELEM_SIZE(*array) * idx);
 
     memmove(elem_slot + array->elem_size,
             elem_slot,
-            array->elem_size * (array->used - idx));
+            ARRAY_ELEM_SIZE(*array) * (array->used - idx));
 
     memcpy(elem_slot, elem, array->elem_size);
 
@@ -167,16 +221,16 @@ void * _array_insert(array_t *array, int idx, void *elem) {
     return elem_slot;
 }
 
-void _array_delete(array_t *array, int idx) {
+void _array_delete(array_t *array, uint64_t idx) {
     void *split;
 
     assert(idx < array->used && "can't delete from arbitrary place in array");
 
     if (idx != array->used - 1) {
-        split = array->data + (array->elem_size * idx);
+        split = array->data + (ARRAY_ELEM_SIZE(*array) * idx);
         memmove(split,
                 split + array->elem_size,
-                array->elem_size * (array->used - idx - 1));
+                ARRAY_ELEM_SIZE(*array) * (array->used - idx - 1));
     }
 
     array->used -= 1;
@@ -184,7 +238,7 @@ void _array_delete(array_t *array, int idx) {
 
 void _array_zero_term(array_t *array) {
     _array_grow_if_needed(array);
-    memset(array->data + (array->used * array->elem_size),
+    memset(array->data + (array->used * ARRAY_ELEM_SIZE(*array)),
            0,
            array->elem_size);
 }
@@ -193,5 +247,5 @@ void _array_copy(array_t *dst, array_t *src) {
     _array_grow_if_needed_to(dst, src->used);
 
     dst->used = src->used;
-    memcpy(dst->data, src->data, src->used * src->elem_size);
+    memcpy(dst->data, src->data, src->used * ARRAY_ELEM_SIZE(*src));
 }
@@ -1,26 +1,41 @@
 #ifndef __ARRAY_H__
 #define __ARRAY_H__
 
+#include <assert.h>
+#include <stdint.h>
+
 #define ARRAY_DEFAULT_CAP (16)
 
+/* Sizes and counts are 64 bits wide. The capacity, the flag, the tag and
+ * the element size share a word so that an array_t stays as small as it
+ * was when they were all ints: up to 2^43 elements of up to 64 KiB each.
+ * The tag is the includer's: array.c never looks at it, but it is there
+ * for the allocation hooks to see, e.g. to tell what the storage is for. */
+#define ARRAY_MAX_ELEM_SIZE (0xFFFF)
+#define ARRAY_MAX_CAP       ((1ULL << 43) - 1)
+#define ARRAY_MAX_TAG       (0xF)
+
 typedef struct {
-    void *data;
-    int   elem_size;
-    int   used;
-    int   capacity;
-    int   should_free;
+    void     *data;
+    uint64_t  used;
+    uint64_t  capacity    : 43;
+    uint64_t  should_free : 1;
+    uint64_t  tag         : 4;
+    uint64_t  elem_size   : 16;
 } array_t;
 
 array_t _array_make(int elem_size);
-array_t _array_make_with_cap(int elem_size, int initial_cap);
+array_t _array_make_with_cap(int elem_size, uint64_t initial_cap);
+array_t _array_make_tagged(int elem_size, int tag);
 void _array_free(array_t *array);
 void * _array_push(array_t *array, void *elem);
-void * _array_push_n(array_t *array, void *elems, int n);
+void * _array_push_n(array_t *array, void *elems, uint64_t n);
 void * _array_next_elem(array_t *array);
-void * _array_insert(array_t *array, int idx, void *elem);
-void _array_delete(array_t *array, int idx);
+void * _array_insert(array_t *array, uint64_t idx, void *elem);
+void _array_delete(array_t *array, uint64_t idx);
 void _array_zero_term(array_t *array);
 void _array_grow_if_needed(array_t *array);
+void _array_grow_if_needed_to(array_t *array, uint64_t new_cap);
 void _array_copy(array_t *dst, array_t *src);
 
 #define array_make(T) \
@@ -29,6 +44,9 @@ void _array_copy(array_t *dst, array_t *src);
 #define array_make_with_cap(T, cap) \
     (_array_make_with_cap(sizeof(T), (cap)))
 
+#define array_make_tagged(T, tag) \
+    (_array_make_tagged(sizeof(T), (tag)))
+
 #define array_free(array) \
     (_array_free(&(array)))
 
@@ -56,26 +74,32 @@ void _array_copy(array_t *dst, array_t *src);
 #define array_clear(array) \
     ((array).used = 0)
 
+/* elem_size is a narrow bit-field, so it would be promoted to int: widen it
+   before computing an offset. */
+#define ARRAY_ELEM_SIZE(array) ((uint64_t)(array).elem_size)
+
 #define array_item(array, idx) \
-    ((array).data + ((array).elem_size * (idx)))
+    ((array).data + (ARRAY_ELEM_SIZE(array) * (idx)))
 
 #define array_last(array) \
-    ((array).used ? ((array).data + ((array).elem_size * ((array).used - 1))) : NULL)
+    ((array).used ? ((array).data + (ARRAY_ELEM_SIZE(array) * ((array).used - 1))) : NULL)
 
 
-#define array_traverse(array, it)                                                \
-    for (it = (array).data;                                                      \
-         it < (__typeof(it))((array).data + ((array).used * (array).elem_size)); \
+/* The traversals step by the size of *it, which the compiler knows, rather
+   than by elem_size, which it doesn't. */
+#define array_traverse(array, it)                                   \
+    for (it = (array).data;                                         \
+         it < (__typeof(it))(array).data + (array).used;            \
          it += 1)
 
-#define array_traverse_from(array, it, starting_idx)                             \
-    for (it = (array).data + ((starting_idx) * (array).elem_size);               \
-         it < (__typeof(it))((array).data + ((array).used * (array).elem_size)); \
+#define array_traverse_from(array, it, starting_idx)                \
+    for (it = (__typeof(it))(array).data + (starting_idx);          \
+         it < (__typeof(it))(array).data + (array).used;            \
          it += 1)
 
-#define array_rtraverse(array, it)                                     \
-    for (it = (array).data + (((array).used - 1) * (array).elem_size); \
-         (array).used && it >= (__typeof(it))((array).data);           \
+#define array_rtraverse(array, it)                                  \
+    for (it = (__typeof(it))(array).data + ((array).used - 1);      \
+         (array).used && it >= (__typeof(it))((array).data);        \
          it -= 1)
 
 #define array_data(array) ((array).data)
@@ -88,4 +112,76 @@ void _array_copy(array_t *dst, array_t *src);
 #define array_copy(dst, src) \
     (_array_copy(&(dst), &(src)))
 
+
+/*
+ * Typed operations. use_array(T) generates versions of the hottest
+ * operations for arrays of T, which must be a single identifier (typedef
+ * pointer types first). They work on any array_t made with array_make(T),
+ * but with sizeof(T) known, so the compiler can inline them and turn the
+ * copies into plain loads and stores. push takes a pointer like
+ * array_push does; passing T by value costs an extra copy of the struct.
+ * The element may live in the array itself: push copies it aside before
+ * growing. push_n doesn't, so its elements must not come from the array
+ * they are pushed onto:
+ *
+ *     use_array(Node);
+ *     ...
+ *     array_call(Node, push)(&list, &node);
+ *     node_ptr = array_call(Node, item)(&list, 3);
+ */
+
+#define _ARRAY_CAT3(x, y, z) __ARRAY_CAT3(x, y, z)
+#define __ARRAY_CAT3(x, y, z) x##y##z
+
+#define array_call(T, op) (_ARRAY_CAT3(_array_, T, _##op))
+
+#define use_array(T)                                                             \
+    static inline T *array_call(T, item)(array_t *array, uint64_t idx) {         \
+        return (T*)array->data + idx;                                            \
+    }                                                                            \
+                                                                                 \
+    static inline T *array_call(T, last)(array_t *array) {                       \
+        return array->used ? (T*)array->data + array->used - 1 : NULL;           \
+    }                                                                            \
+                                                                                 \
+    static inline T *array_call(T, push)(array_t *array, const T *elem) {        \
+        T *slot;                                                                 \
+        T  saved;                                                                \
+                                                                                 \
+        if (__builtin_expect(array->data == NULL                                 \
+                             || array->used >= array->capacity, 0)) {            \
+            saved = *elem;                                                       \
+            elem  = &saved;                                                      \
+            _array_grow_if_needed(array);                                        \
+        }                                                                        \
+                                                                                 \
+        slot         = (T*)array->data + array->used;                            \
+        *slot        = *elem;                                                    \
+        array->used += 1;                                                        \
+                                                                                 \
+        return slot;                                                             \
+    }                                                                            \
+                                                                                 \
+    static inline T *array_call(T, push_n)(array_t *array, const T *elems,       \
+                                           uint64_t n) {                         \
+        T *slot;                                                                 \
+                                                                                 \
+        if (__builtin_expect(array->data == NULL                                 \
+                             || array->used + n > array->capacity, 0)) {         \
+            _array_grow_if_needed_to(array, array->used + n);                    \
+        }                                                                        \
+                                                                                 \
+        slot         = (T*)array->data + array->used;                            \
+        array->used += n;                                                        \
+        if (n) { memcpy(slot, elems, n * sizeof(T)); }                           \
+                                                                                 \
+        return slot;                                                             \
+    }                                                                            \
+                                                                                 \
+    static inline T array_call(T, pop)(array_t *array) {                         \
+        assert(array->used > 0 && "pop from an empty array");                    \
+        array->used -= 1;                                                        \
+        return ((T*)array->data)[array->used];                                   \
+    }                                                                            \
+
 #endif
@@ -5,6 +5,28 @@
  *
  * "generic", type-safe hash_table implementation for C
  *
+ * The tables use open addressing in the style of Abseil's "Swiss tables".
+ * Keys and values are stored inline in a power-of-two array of slots. A
+ * parallel array holds one control byte per slot: empty, deleted, or 7
+ * bits of the hash of the key that lives there. Lookups probe the control
+ * bytes 16 at a time (with SSE2 where available) and only compare keys
+ * whose 7 hash bits match.
+ *
+ * use_hash_table(K_T, V_T) calls the hash and equality functions given to
+ * hash_table_make() through pointers. use_hash_table_with(K_T, V_T, HASH,
+ * EQU) builds them in, so they can be inlined. Either way, the operations
+ * can be called through the table, e.g. hash_table_get_val(t, k), or
+ * directly, e.g. hash_table_call(K_T, V_T, get_val)(t, k), which lets the
+ * compiler inline them.
+ *
+ * A table made with hash_table_make_incremental() doesn't move all of its
+ * entries at once when it grows. It keeps the old slots around and moves a
+ * few of them on each insertion or deletion, looking in both until they are
+ * all moved, so that no single operation takes time proportional to the
+ * size of the table.
+ *
+ * Pointers returned by hash_table_get_key() and hash_table_get_val() are
+ * only good until the next insertion into or deletion from the table.
  */
 
 #ifndef _HASH_TABLE_H_
@@ -14,35 +36,36 @@
 #include <stdlib.h> /* malloc, free */
 #include <string.h> /* memcpy, memset */
 
-#define hash_table_make(K_T, V_T, HASH) (CAT2(hash_table(K_T, V_T), _make)((HASH), NULL))
-#define hash_table_make_e(K_T, V_T, HASH, EQU) (CAT2(hash_table(K_T, V_T), _make)((HASH), (EQU)))
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define hash_table_make(K_T, V_T, HASH) (CAT2(hash_table(K_T, V_T), _make)((HASH), NULL, 0))
+#define hash_table_make_e(K_T, V_T, HASH, EQU) (CAT2(hash_table(K_T, V_T), _make)((HASH), (EQU), 0))
+#define hash_table_make_incremental(K_T, V_T, HASH, EQU) (CAT2(hash_table(K_T, V_T), _make)((HASH), (EQU), 1))
 #define hash_table_len(t) (t->len)
 #define hash_table_free(t) (t->_free((t)))
 #define hash_table_get_key(t, k) (t->_get_key((t), (k)))
 #define hash_table_get_val(t, k) (t->_get_val((t), (k)))
 #define hash_table_insert(t, k, v) (t->_insert((t), (k), (v)))
 #define hash_table_delete(t, k) (t->_delete((t), (k)))
-#define hash_table_traverse(t, key, val_ptr)                     \
-    for (/* vars */                                              \
-         uint64_t __i    = 0,                                    \
-                  __size = ht_prime_sizes[t->_size_idx];         \
-         /* conditions */                                        \
-         __i < __size;                                           \
-         /* increment */                                         \
-         __i += 1)                                               \
-        for (/* vars */                                          \
-             __typeof__(*t->_data) *__slot_ptr = t->_data + __i, \
-                                    __slot     = *__slot_ptr;    \
-                                                                 \
-             /* conditions */                                    \
-             __slot != NULL                 &&                   \
-             (key     = __slot->_key   , 1) &&                   \
-             (val_ptr = &(__slot->_val), 1);                     \
-                                                                 \
-             /* increment */                                     \
-             __slot_ptr = &(__slot->_next),                      \
-             __slot = *__slot_ptr)                               \
-            /* LOOP BODY HERE */                                 \
+#define hash_table_call(K_T, V_T, op) (CAT3(hash_table(K_T, V_T), _, op))
+#define hash_table_traverse(t, key, val_ptr)                                   \
+    for (/* vars */                                                            \
+         uint64_t __i = 0;                                                     \
+         /* conditions */                                                      \
+         __i < t->_cap + t->_old_cap;                                          \
+         /* increment */                                                       \
+         __i += 1)                                                             \
+        for (/* vars */                                                        \
+             int __full = _HT_CTRL(t, __i) >= 0                 &&             \
+                          (key     = _HT_SLOT(t, __i)->_key, 1)   &&             \
+                          (val_ptr = &(_HT_SLOT(t, __i)->_val), 1);            \
+             /* conditions */                                                  \
+             __full;                                                           \
+             /* increment */                                                   \
+             __full = 0)                                                       \
+            /* LOOP BODY HERE */                                               \
 
 
 #define STR(x) _STR(x)
@@ -63,86 +86,126 @@
 #define hash_table(K_T, V_T) CAT4(hash_table_, K_T, _, V_T)
 #define hash_table_pretty_name(K_T, V_T) ("hash_table(" CAT3(K_T, ", ", V_T) ")")
 
+/* Slot i of the table, counting on from the new slots into the old ones
+   while an incremental resize is in progress. */
+#define _HT_CTRL(t, i) \
+    ((i) < (t)->_cap ? (t)->_ctrl[(i)] : (t)->_old_ctrl[(i) - (t)->_cap])
+#define _HT_SLOT(t, i) \
+    ((i) < (t)->_cap ? &(t)->_slots[(i)] : &(t)->_old_slots[(i) - (t)->_cap])
+
 #define _HASH_TABLE_EQU(t_ptr, l, r) \
     ((t_ptr)->_equ ? (t_ptr)->_equ((l), (r)) : (l) == (r))
 
-#define DEFAULT_START_SIZE_IDX (3)
-
-static uint64_t ht_prime_sizes[] = {
-  5ULL,
-  11ULL,
-  23ULL,
-  47ULL,
-  97ULL,
-  199ULL,
-  409ULL,
-  823ULL,
-  1741ULL,
-  3469ULL,
-  6949ULL,
-  14033ULL,
-  28411ULL,
-  57557ULL,
-  116731ULL,
-  236897ULL,
-  480881ULL,
-  976369ULL,
-  1982627ULL,
-  4026031ULL,
-  8175383ULL,
-  16601593ULL,
-  33712729ULL,
-  68460391ULL,
-  139022417ULL,
-  282312799ULL,
-  573292817ULL,
-  1164186217ULL,
-  2364114217ULL,
-  4294967291ULL,
-  8589934583ULL,
-  17179869143ULL,
-  34359738337ULL,
-  68719476731ULL,
-  137438953447ULL,
-  274877906899ULL,
-  549755813881ULL,
-  1099511627689ULL,
-  2199023255531ULL,
-  4398046511093ULL,
-  8796093022151ULL,
-  17592186044399ULL,
-  35184372088777ULL,
-  70368744177643ULL,
-  140737488355213ULL,
-  281474976710597ULL,
-  562949953421231ULL,
-  1125899906842597ULL,
-  2251799813685119ULL,
-  4503599627370449ULL,
-  9007199254740881ULL,
-  18014398509481951ULL,
-  36028797018963913ULL,
-  72057594037927931ULL,
-  144115188075855859ULL,
-  288230376151711717ULL,
-  576460752303423433ULL,
-  1152921504606846883ULL,
-  2305843009213693951ULL,
-  4611686018427387847ULL,
-  9223372036854775783ULL,
-  18446744073709551557ULL
-};
+/* Control bytes. Full slots hold 7 bits of their key's hash, so they are
+   never negative. */
+#define HT_EMPTY    ((int8_t)-128)
+#define HT_DELETED  ((int8_t)-2)
+#define HT_GROUP    (16)
+#define HT_MIN_CAP  (16)
+
+/* How many old slots an incremental table moves per insertion or
+   deletion. A table that has just doubled has room for at least as many
+   new entries as it had slots before, so it is done moving them long
+   before it fills up again. */
+#define HT_MIGRATE_STEP (2 * HT_GROUP)
+
+/* At most 7/8 of the slots may be in use, counting deleted ones. */
+#define HT_MAX_LOAD(cap) ((cap) - (cap) / 8)
+
+/* Spread the bits of a hash over the whole word, so that weak hashes still
+   give us good table positions (h1) and control bytes (h2). */
+static inline uint64_t ht_mix(uint64_t h) {
+    h *= 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 32);
+}
+
+#define HT_H1(h) ((h) >> 7)
+#define HT_H2(h) ((int8_t)((h) & 0x7F))
+
+/* Bitmasks of the slots in the group of HT_GROUP control bytes at ctrl that
+   hold h2, that are empty, and that are empty or deleted. */
+#if defined(__SSE2__)
+
+static inline uint32_t ht_group_match(const int8_t *ctrl, int8_t h2) {
+    __m128i g = _mm_load_si128((const __m128i*)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(h2)));
+}
+
+static inline uint32_t ht_group_empty(const int8_t *ctrl) {
+    __m128i g = _mm_load_si128((const __m128i*)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(HT_EMPTY)));
+}
+
+static inline uint32_t ht_group_free(const int8_t *ctrl) {
+    return _mm_movemask_epi8(_mm_load_si128((const __m128i*)ctrl));
+}
+
+#else
+
+static inline uint32_t ht_group_match(const int8_t *ctrl, int8_t h2) {
+    uint32_t m = 0;
+    for (int i = 0; i < HT_GROUP; i += 1) { m |= (uint32_t)(ctrl[i] == h2) << i; }
+    return m;
+}
+
+static inline uint32_t ht_group_empty(const int8_t *ctrl) {
+    return ht_group_match(ctrl, HT_EMPTY);
+}
+
+static inline uint32_t ht_group_free(const int8_t *ctrl) {
+    uint32_t m = 0;
+    for (int i = 0; i < HT_GROUP; i += 1) { m |= (uint32_t)(ctrl[i] < 0) << i; }
+    return m;
+}
+
+#endif
+
+/* Walk the groups of a table with capacity `cap` in the order a key with
+   hash h probes them. Stepping by 1, 2, 3, ... groups visits every group
+   when the number of groups is a power of two. */
+#define HT_PROBE(cap, h, group, step)                                  \
+    for ((step) = 0, (group) = HT_H1(h) & ((cap) - 1) & ~(uint64_t)(HT_GROUP - 1); \
+         ;                                                              \
+         (step) += 1, (group) = ((group) + (step) * HT_GROUP) & ((cap) - 1))
 
 #define use_hash_table(K_T, V_T)                                                             \
+    _use_hash_table_types(K_T, V_T)                                                          \
+                                                                                             \
+    static inline uint64_t                                                                   \
+        CAT2(hash_table(K_T, V_T), _hash_fn)(hash_table(K_T, V_T) t, K_T key) {              \
+        return t->_hash(key);                                                                \
+    }                                                                                        \
+    static inline int                                                                        \
+        CAT2(hash_table(K_T, V_T), _equ_fn)(hash_table(K_T, V_T) t, K_T a, K_T b) {          \
+        return _HASH_TABLE_EQU(t, a, b);                                                     \
+    }                                                                                        \
+                                                                                             \
+    _use_hash_table_fns(K_T, V_T)
+
+#define use_hash_table_with(K_T, V_T, HASH, EQU)                                             \
+    _use_hash_table_types(K_T, V_T)                                                          \
+                                                                                             \
+    static inline uint64_t                                                                   \
+        CAT2(hash_table(K_T, V_T), _hash_fn)(hash_table(K_T, V_T) t, K_T key) {              \
+        (void)t;                                                                             \
+        return HASH(key);                                                                    \
+    }                                                                                        \
+    static inline int                                                                        \
+        CAT2(hash_table(K_T, V_T), _equ_fn)(hash_table(K_T, V_T) t, K_T a, K_T b) {          \
+        (void)t;                                                                             \
+        return EQU(a, b);                                                                    \
+    }                                                                                        \
+                                                                                             \
+    _use_hash_table_fns(K_T, V_T)
+
+#define _use_hash_table_types(K_T, V_T)                                                      \
     struct _hash_table(K_T, V_T);                                                            \
                                                                                              \
     typedef struct _hash_table_slot(K_T, V_T) {                                              \
         K_T _key;                                                                            \
         V_T _val;                                                                            \
-        uint64_t _hash;                                                                      \
-        struct _hash_table_slot(K_T, V_T) *_next;                                            \
     }                                                                                        \
-    *hash_table_slot(K_T, V_T);                                                              \
+    hash_table_slot(K_T, V_T);                                                               \
                                                                                              \
     typedef void (*CAT2(hash_table(K_T, V_T), _free_t))                                      \
         (struct _hash_table(K_T, V_T) *);                                                    \
@@ -158,8 +221,15 @@ static uint64_t ht_prime_sizes[] = {
     typedef int (*CAT2(hash_table(K_T, V_T), _equ_t))(K_T, K_T);                             \
                                                                                              \
     typedef struct _hash_table(K_T, V_T) {                                                   \
-        hash_table_slot(K_T, V_T) *_data;                                                    \
-        uint64_t len, _size_idx, _load_thresh;                                               \
+        int8_t                    *_ctrl;                                                    \
+        hash_table_slot(K_T, V_T) *_slots;                                                   \
+        uint64_t len, _cap, _deleted, _growth_left;                                          \
+                                                                                             \
+        /* Slots not yet moved by an incremental resize, if one is going on. */              \
+        int8_t                    *_old_ctrl;                                                \
+        hash_table_slot(K_T, V_T) *_old_slots;                                               \
+        uint64_t _old_cap, _migrated;                                                        \
+        int      _incremental;                                                               \
                                                                                              \
         CAT2(hash_table(K_T, V_T), _free_t)    const _free;                                  \
         CAT2(hash_table(K_T, V_T), _get_key_t) const _get_key;                               \
@@ -170,153 +240,236 @@ static uint64_t ht_prime_sizes[] = {
         CAT2(hash_table(K_T, V_T), _equ_t)     const _equ;                                   \
     }                                                                                        \
     *hash_table(K_T, V_T);                                                                   \
+
+#define _use_hash_table_fns(K_T, V_T)                                                        \
+    /* Point the table at fresh, empty storage for `cap` slots. The control */               \
+    /* bytes and the slots share one allocation. */                                          \
+    static inline void                                                                       \
+        CAT2(hash_table(K_T, V_T), _alloc)(hash_table(K_T, V_T) t, uint64_t cap) {           \
+        char *block;                                                                         \
+                                                                                             \
+        block = malloc(cap + cap * sizeof(hash_table_slot(K_T, V_T)));                       \
+        memset(block, HT_EMPTY, cap);                                                        \
                                                                                              \
-    /* hash_table slot */                                                                    \
-    static inline hash_table_slot(K_T, V_T)                                                  \
-        CAT2(hash_table_slot(K_T, V_T), _make)(K_T key, V_T val, uint64_t hash) {            \
-        hash_table_slot(K_T, V_T) slot = malloc(sizeof(*slot));                              \
+        t->_ctrl        = (int8_t*)block;                                                    \
+        t->_slots       = (hash_table_slot(K_T, V_T)*)(block + cap);                         \
+        t->_cap         = cap;                                                               \
+        t->_deleted     = 0;                                                                 \
+        t->_growth_left = HT_MAX_LOAD(cap) - t->len;                                         \
+    }                                                                                        \
                                                                                              \
-        slot->_key  = key;                                                                   \
-        slot->_val  = val;                                                                   \
-        slot->_hash = hash;                                                                  \
-        slot->_next = NULL;                                                                  \
+    /* The first empty or deleted slot on the probe sequence for h. */                       \
+    static inline uint64_t                                                                   \
+        CAT2(hash_table(K_T, V_T), _find_free)(hash_table(K_T, V_T) t, uint64_t h) {         \
+        uint64_t group, step;                                                                \
+        uint32_t m;                                                                          \
                                                                                              \
-        return slot;                                                                         \
+        HT_PROBE(t->_cap, h, group, step) {                                                  \
+            if ((m = ht_group_free(t->_ctrl + group))) {                                     \
+                return group + __builtin_ctz(m);                                             \
+            }                                                                                \
+        }                                                                                    \
     }                                                                                        \
                                                                                              \
-    /* hash_table */                                                                         \
-    static inline void CAT2(hash_table(K_T, V_T), _rehash_insert)                            \
-        (hash_table(K_T, V_T) t, hash_table_slot(K_T, V_T) insert_slot) {                    \
+    /* The slot holding key among `cap` slots, or -1. */                                     \
+    static inline int64_t                                                                    \
+        CAT2(hash_table(K_T, V_T), _find_in)(hash_table(K_T, V_T) t, int8_t *ctrl,           \
+                                             hash_table_slot(K_T, V_T) *slots,               \
+                                             uint64_t cap, K_T key, uint64_t h) {            \
+        uint64_t group, step;                                                                \
+        uint32_t m;                                                                          \
+        uint64_t idx;                                                                        \
+                                                                                             \
+        HT_PROBE(cap, h, group, step) {                                                      \
+            for (m = ht_group_match(ctrl + group, HT_H2(h)); m; m &= m - 1) {                \
+                idx = group + __builtin_ctz(m);                                              \
+                if (CAT2(hash_table(K_T, V_T), _equ_fn)(t, slots[idx]._key, key)) {          \
+                    return idx;                                                              \
+                }                                                                            \
+            }                                                                                \
+            if (ht_group_empty(ctrl + group)) { return -1; }                                 \
+        }                                                                                    \
+    }                                                                                        \
                                                                                              \
-        uint64_t h, data_size, idx;                                                          \
-        hash_table_slot(K_T, V_T) slot, *slot_ptr;                                           \
+    static inline int64_t                                                                    \
+        CAT2(hash_table(K_T, V_T), _find)(hash_table(K_T, V_T) t, K_T key, uint64_t h) {     \
+        return CAT2(hash_table(K_T, V_T), _find_in)                                          \
+                (t, t->_ctrl, t->_slots, t->_cap, key, h);                                   \
+    }                                                                                        \
                                                                                              \
-        h         = insert_slot->_hash;                                                      \
-        data_size = ht_prime_sizes[t->_size_idx];                                            \
-        idx       = h % data_size;                                                           \
-        slot_ptr  = t->_data + idx;                                                          \
+    static inline int64_t                                                                    \
+        CAT2(hash_table(K_T, V_T), _find_old)(hash_table(K_T, V_T) t, K_T key, uint64_t h) { \
+        if (t->_old_cap == 0) { return -1; }                                                 \
+        return CAT2(hash_table(K_T, V_T), _find_in)                                          \
+                (t, t->_old_ctrl, t->_old_slots, t->_old_cap, key, h);                       \
+    }                                                                                        \
                                                                                              \
-        while ((slot = *slot_ptr))    { slot_ptr = &(slot->_next); }                         \
+    /* How many groups past its first one the key in slot idx lives. */                      \
+    static inline uint64_t                                                                   \
+        CAT2(hash_table(K_T, V_T), _probe_len)(hash_table(K_T, V_T) t, uint64_t idx) {       \
+        uint64_t h, group, step;                                                             \
                                                                                              \
-        *slot_ptr = insert_slot;                                                             \
+        h = ht_mix(CAT2(hash_table(K_T, V_T), _hash_fn)(t, t->_slots[idx]._key));            \
+        HT_PROBE(t->_cap, h, group, step) {                                                  \
+            if (idx - group < HT_GROUP) { return step; }                                     \
+        }                                                                                    \
     }                                                                                        \
                                                                                              \
+    /* Move up to n of the slots left over from an incremental resize into the */            \
+    /* new ones. Their room there was set aside when the resize started. */                  \
     static inline void                                                                       \
-        CAT2(hash_table(K_T, V_T), _update_load_thresh)(hash_table(K_T, V_T) t) {            \
+        CAT2(hash_table(K_T, V_T), _migrate)(hash_table(K_T, V_T) t, uint64_t n) {           \
+        uint64_t end, h, idx;                                                                \
                                                                                              \
-        uint64_t cur_size;                                                                   \
+        end = t->_migrated + n < t->_old_cap ? t->_migrated + n : t->_old_cap;               \
                                                                                              \
-        cur_size        = ht_prime_sizes[t->_size_idx];                                      \
-        t->_load_thresh = ((double)((cur_size << 1ULL))                                      \
-                            / ((double)(cur_size * 3)))                                      \
-                            * cur_size;                                                      \
-    }                                                                                        \
+        for (; t->_migrated < end; t->_migrated += 1) {                                      \
+            if (t->_old_ctrl[t->_migrated] < 0) { continue; }                                \
                                                                                              \
-    static inline void CAT2(hash_table(K_T, V_T), _rehash)(hash_table(K_T, V_T) t) {         \
-        uint64_t                   old_size,                                                 \
-                                   new_data_size;                                            \
-        hash_table_slot(K_T, V_T) *old_data,                                                 \
-                                   slot,                                                     \
-                                  *slot_ptr,                                                 \
-                                   next;                                                     \
-                                                                                             \
-        old_size      = ht_prime_sizes[t->_size_idx];                                        \
-        old_data      = t->_data;                                                            \
-        t->_size_idx += 1;                                                                   \
-        new_data_size = sizeof(hash_table_slot(K_T, V_T)) * ht_prime_sizes[t->_size_idx];    \
-        t->_data      = malloc(new_data_size);                                               \
-        memset(t->_data, 0, new_data_size);                                                  \
-                                                                                             \
-        for (int i = 0; i < old_size; i += 1) {                                              \
-            slot_ptr = old_data + i;                                                         \
-            next = *slot_ptr;                                                                \
-            while ((slot = next)) {                                                          \
-                next        = slot->_next;                                                   \
-                slot->_next = NULL;                                                          \
-                CAT2(hash_table(K_T, V_T), _rehash_insert)(t, slot);                         \
+            h   = ht_mix(CAT2(hash_table(K_T, V_T), _hash_fn)                                \
+                             (t, t->_old_slots[t->_migrated]._key));                         \
+            idx = CAT2(hash_table(K_T, V_T), _find_free)(t, h);                              \
+            if (t->_ctrl[idx] == HT_DELETED) {                                               \
+                t->_deleted     -= 1;                                                        \
+                t->_growth_left += 1;                                                        \
             }                                                                                \
+            t->_ctrl[idx]                = HT_H2(h);                                         \
+            t->_slots[idx]               = t->_old_slots[t->_migrated];                      \
+            t->_old_ctrl[t->_migrated]   = HT_DELETED;                                       \
+        }                                                                                    \
+                                                                                             \
+        if (t->_migrated == t->_old_cap) {                                                   \
+            free(t->_old_ctrl);                                                              \
+            t->_old_ctrl  = NULL;                                                            \
+            t->_old_slots = NULL;                                                            \
+            t->_old_cap   = 0;                                                               \
+            t->_migrated  = 0;                                                               \
+        }                                                                                    \
+    }                                                                                        \
+                                                                                             \
+    /* Move everything into new storage for `cap` slots, dropping the deleted */             \
+    /* ones along the way. An incremental table only sets the old slots aside */             \
+    /* here; _migrate() moves them later. */                                                 \
+    static inline void                                                                       \
+        CAT2(hash_table(K_T, V_T), _resize)(hash_table(K_T, V_T) t, uint64_t cap) {          \
+        int8_t   *old_ctrl;                                                                  \
+        hash_table_slot(K_T, V_T)     *old_slots;                                            \
+        uint64_t  old_cap, i, h, idx;                                                        \
+                                                                                             \
+        if (t->_old_cap) { CAT2(hash_table(K_T, V_T), _migrate)(t, t->_old_cap); }           \
+                                                                                             \
+        old_ctrl  = t->_ctrl;                                                                \
+        old_slots = t->_slots;                                                               \
+        old_cap   = t->_cap;                                                                 \
+                                                                                             \
+        CAT2(hash_table(K_T, V_T), _alloc)(t, cap);                                          \
+                                                                                             \
+        if (t->_incremental) {                                                               \
+            t->_old_ctrl  = old_ctrl;                                                        \
+            t->_old_slots = old_slots;                                                       \
+            t->_old_cap   = old_cap;                                                         \
+            t->_migrated  = 0;                                                               \
+            return;                                                                          \
         }                                                                                    \
                                                                                              \
-        free(old_data);                                                                      \
+        for (i = 0; i < old_cap; i += 1) {                                                   \
+            if (old_ctrl[i] < 0) { continue; }                                               \
+            h              = ht_mix(CAT2(hash_table(K_T, V_T), _hash_fn)                     \
+                                        (t, old_slots[i]._key));                             \
+            idx            = CAT2(hash_table(K_T, V_T), _find_free)(t, h);                   \
+            t->_ctrl[idx]  = HT_H2(h);                                                       \
+            t->_slots[idx] = old_slots[i];                                                   \
+        }                                                                                    \
                                                                                              \
-        CAT2(hash_table(K_T, V_T), _update_load_thresh)(t);                                  \
+        free(old_ctrl);                                                                      \
     }                                                                                        \
                                                                                              \
     static inline void                                                                       \
         CAT2(hash_table(K_T, V_T), _insert)(hash_table(K_T, V_T) t, K_T key, V_T val) {      \
-        uint64_t h, data_size, idx;                                                          \
-        hash_table_slot(K_T, V_T) slot, *slot_ptr;                                           \
-                                                                                             \
-        h         = t->_hash(key);                                                           \
-        data_size = ht_prime_sizes[t->_size_idx];                                            \
-        idx       = h % data_size;                                                           \
-        slot_ptr  = t->_data + idx;                                                          \
-                                                                                             \
-        while ((slot = *slot_ptr)) {                                                         \
-            if (_HASH_TABLE_EQU(t, slot->_key, key)) {                                       \
-                slot->_val = val;                                                            \
-                return;                                                                      \
-            }                                                                                \
-            slot_ptr = &(slot->_next);                                                       \
+        uint64_t h, idx;                                                                     \
+        int64_t  found;                                                                      \
+                                                                                             \
+        if (t->_old_cap) { CAT2(hash_table(K_T, V_T), _migrate)(t, HT_MIGRATE_STEP); }       \
+                                                                                             \
+        h = ht_mix(CAT2(hash_table(K_T, V_T), _hash_fn)(t, key));                            \
+                                                                                             \
+        if ((found = CAT2(hash_table(K_T, V_T), _find)(t, key, h)) >= 0) {                   \
+            t->_slots[found]._val = val;                                                     \
+            return;                                                                          \
+        }                                                                                    \
+        if ((found = CAT2(hash_table(K_T, V_T), _find_old)(t, key, h)) >= 0) {               \
+            t->_old_slots[found]._val = val;                                                 \
+            return;                                                                          \
         }                                                                                    \
                                                                                              \
-        *slot_ptr = CAT2(hash_table_slot(K_T, V_T), _make)(key, val, h);                     \
-        t->len   += 1;                                                                       \
+        idx = CAT2(hash_table(K_T, V_T), _find_free)(t, h);                                  \
+        if (t->_ctrl[idx] == HT_EMPTY && t->_growth_left == 0) {                             \
+            /* Mostly tombstones? Clean them up in place. Otherwise grow. */                 \
+            CAT2(hash_table(K_T, V_T), _resize)(t, t->len * 2 < HT_MAX_LOAD(t->_cap)         \
+                                ? t->_cap                                                    \
+                                : t->_cap * 2);                                              \
+            idx = CAT2(hash_table(K_T, V_T), _find_free)(t, h);                              \
+        }                                                                                    \
                                                                                              \
-        if (t->len == t->_load_thresh) {                                                     \
-            CAT2(hash_table(K_T, V_T), _rehash)(t);                                          \
+        if (t->_ctrl[idx] == HT_EMPTY) {                                                     \
+            t->_growth_left -= 1;                                                            \
+        } else {                                                                             \
+            t->_deleted -= 1;                                                                \
         }                                                                                    \
+                                                                                             \
+        t->_ctrl[idx]       = HT_H2(h);                                                      \
+        t->_slots[idx]._key = key;                                                           \
+        t->_slots[idx]._val = val;                                                           \
+        t->len             += 1;                                                             \
     }                                                                                        \
                                                                                              \
     static inline int CAT2(hash_table(K_T, V_T), _delete)                                    \
         (hash_table(K_T, V_T) t, K_T key) {                                                  \
                                                                                              \
-        uint64_t h, data_size, idx;                                                          \
-        hash_table_slot(K_T, V_T) slot, prev, *slot_ptr;                                     \
+        uint64_t h;                                                                          \
+        int64_t  idx;                                                                        \
                                                                                              \
-        h = t->_hash(key);                                                                   \
-        data_size = ht_prime_sizes[t->_size_idx];                                            \
-        idx = h % data_size;                                                                 \
-        slot_ptr = t->_data + idx;                                                           \
-        prev = NULL;                                                                         \
+        if (t->_old_cap) { CAT2(hash_table(K_T, V_T), _migrate)(t, HT_MIGRATE_STEP); }       \
                                                                                              \
-        while ((slot = *slot_ptr)) {                                                         \
-            if (_HASH_TABLE_EQU(t, slot->_key, key)) {                                       \
-                break;                                                                       \
-            }                                                                                \
-            prev     = slot;                                                                 \
-            slot_ptr = &(slot->_next);                                                       \
-        }                                                                                    \
+        h = ht_mix(CAT2(hash_table(K_T, V_T), _hash_fn)(t, key));                            \
                                                                                              \
-        if ((slot = *slot_ptr)) {                                                            \
-            if (prev) {                                                                      \
-                prev->_next = slot->_next;                                                   \
-            } else {                                                                         \
-                *slot_ptr = slot->_next;                                                     \
-            }                                                                                \
-            free(slot);                                                                      \
-            t->len -= 1;                                                                     \
+        if ((idx = CAT2(hash_table(K_T, V_T), _find_old)(t, key, h)) >= 0) {                 \
+            /* It had room set aside in the new slots that it won't need. */                 \
+            t->_old_ctrl[idx]  = HT_DELETED;                                                 \
+            t->_growth_left   += 1;                                                          \
+            t->len            -= 1;                                                          \
             return 1;                                                                        \
         }                                                                                    \
-        return 0;                                                                            \
+                                                                                             \
+        if ((idx = CAT2(hash_table(K_T, V_T), _find)(t, key, h)) < 0) { return 0; }          \
+                                                                                             \
+        /* If the group still has an empty slot, no probe sequence ever went */              \
+        /* past it, so this slot can become empty again too. */                              \
+        if (ht_group_empty(t->_ctrl + (idx & ~(int64_t)(HT_GROUP - 1)))) {                   \
+            t->_ctrl[idx]    = HT_EMPTY;                                                     \
+            t->_growth_left += 1;                                                            \
+        } else {                                                                             \
+            t->_ctrl[idx]  = HT_DELETED;                                                     \
+            t->_deleted   += 1;                                                              \
+        }                                                                                    \
+        t->len -= 1;                                                                         \
+                                                                                             \
+        return 1;                                                                            \
     }                                                                                        \
                                                                                              \
     static inline K_T*                                                                       \
         CAT2(hash_table(K_T, V_T), _get_key)(hash_table(K_T, V_T) t, K_T key) {              \
                                                                                              \
-        uint64_t h, data_size, idx;                                                          \
-        hash_table_slot(K_T, V_T) slot, *slot_ptr;                                           \
+        uint64_t h;                                                                          \
+        int64_t  idx;                                                                        \
                                                                                              \
-        h         = t->_hash(key);                                                           \
-        data_size = ht_prime_sizes[t->_size_idx];                                            \
-        idx       = h % data_size;                                                           \
-        slot_ptr  = t->_data + idx;                                                          \
+        h = ht_mix(CAT2(hash_table(K_T, V_T), _hash_fn)(t, key));                            \
                                                                                              \
-        while ((slot = *slot_ptr)) {                                                         \
-            if (_HASH_TABLE_EQU(t, slot->_key, key)) {                                       \
-                return &slot->_key;                                                          \
-            }                                                                                \
-            slot_ptr = &(slot->_next);                                                       \
+        if ((idx = CAT2(hash_table(K_T, V_T), _find)(t, key, h)) >= 0) {                     \
+            return &t->_slots[idx]._key;                                                     \
+        }                                                                                    \
+        if ((idx = CAT2(hash_table(K_T, V_T), _find_old)(t, key, h)) >= 0) {                 \
+            return &t->_old_slots[idx]._key;                                                 \
         }                                                                                    \
                                                                                              \
         return NULL;                                                                         \
@@ -325,64 +478,48 @@ static uint64_t ht_prime_sizes[] = {
     static inline V_T*                                                                       \
         CAT2(hash_table(K_T, V_T), _get_val)(hash_table(K_T, V_T) t, K_T key) {              \
                                                                                              \
-        uint64_t h, data_size, idx;                                                          \
-        hash_table_slot(K_T, V_T) slot, *slot_ptr;                                           \
+        uint64_t h;                                                                          \
+        int64_t  idx;                                                                        \
                                                                                              \
-        h         = t->_hash(key);                                                           \
-        data_size = ht_prime_sizes[t->_size_idx];                                            \
-        idx       = h % data_size;                                                           \
-        slot_ptr  = t->_data + idx;                                                          \
+        h = ht_mix(CAT2(hash_table(K_T, V_T), _hash_fn)(t, key));                            \
                                                                                              \
-        while ((slot = *slot_ptr)) {                                                         \
-            if (_HASH_TABLE_EQU(t, slot->_key, key)) {                                       \
-                return &slot->_val;                                                          \
-            }                                                                                \
-            slot_ptr = &(slot->_next);                                                       \
+        if ((idx = CAT2(hash_table(K_T, V_T), _find)(t, key, h)) >= 0) {                     \
+            return &t->_slots[idx]._val;                                                     \
+        }                                                                                    \
+        if ((idx = CAT2(hash_table(K_T, V_T), _find_old)(t, key, h)) >= 0) {                 \
+            return &t->_old_slots[idx]._val;                                                 \
         }                                                                                    \
                                                                                              \
         return NULL;                                                                         \
     }                                                                                        \
                                                                                              \
     static inline void CAT2(hash_table(K_T, V_T), _free)(hash_table(K_T, V_T) t) {           \
-        for (int i = 0; i < ht_prime_sizes[t->_size_idx]; i += 1) {                          \
-            hash_table_slot(K_T, V_T) next, slot = t->_data[i];                              \
-            while (slot != NULL) {                                                           \
-                next = slot->_next;                                                          \
-                free(slot);                                                                  \
-                slot = next;                                                                 \
-            }                                                                                \
-        }                                                                                    \
-        free(t->_data);                                                                      \
+        free(t->_ctrl);                                                                      \
+        free(t->_old_ctrl);                                                                  \
         free(t);                                                                             \
     }                                                                                        \
                                                                                              \
     static inline hash_table(K_T, V_T)                                                       \
-    CAT2(hash_table(K_T, V_T), _make)(CAT2(hash_table(K_T, V_T), _hash_t) hash, void *equ) { \
+    CAT2(hash_table(K_T, V_T), _make)(CAT2(hash_table(K_T, V_T), _hash_t) hash,              \
+                                      void *equ, int incremental) {                          \
         hash_table(K_T, V_T) t = malloc(sizeof(*t));                                         \
                                                                                              \
-        uint64_t data_size                                                                   \
-            = ht_prime_sizes[DEFAULT_START_SIZE_IDX] * sizeof(hash_table_slot(K_T, V_T));    \
-        hash_table_slot(K_T, V_T) *the_data = malloc(data_size);                             \
-                                                                                             \
-        memset(the_data, 0, data_size);                                                      \
-                                                                                             \
         struct _hash_table(K_T, V_T)                                                         \
-            init = {._size_idx = DEFAULT_START_SIZE_IDX,                                     \
-                    ._data     = the_data,                                                   \
-                    .len       = 0,                                                          \
-                    ._free     = CAT2(hash_table(K_T, V_T), _free),                          \
-                    ._get_key  = CAT2(hash_table(K_T, V_T), _get_key),                       \
-                    ._get_val  = CAT2(hash_table(K_T, V_T), _get_val),                       \
-                    ._insert   = CAT2(hash_table(K_T, V_T), _insert),                        \
-                    ._delete   = CAT2(hash_table(K_T, V_T), _delete),                        \
-                    ._equ      = (CAT2(hash_table(K_T, V_T), _equ_t))equ,                    \
-                    ._hash     = (CAT2(hash_table(K_T, V_T), _hash_t))hash};                 \
+            init = {.len          = 0,                                                       \
+                    ._incremental = incremental,                                             \
+                    ._free        = CAT2(hash_table(K_T, V_T), _free),                       \
+                    ._get_key     = CAT2(hash_table(K_T, V_T), _get_key),                    \
+                    ._get_val     = CAT2(hash_table(K_T, V_T), _get_val),                    \
+                    ._insert      = CAT2(hash_table(K_T, V_T), _insert),                     \
+                    ._delete      = CAT2(hash_table(K_T, V_T), _delete),                     \
+                    ._equ         = (CAT2(hash_table(K_T, V_T), _equ_t))equ,                 \
+                    ._hash        = (CAT2(hash_table(K_T, V_T), _hash_t))hash};              \
                                                                                              \
         memcpy(t, &init, sizeof(*t));                                                        \
                                                                                              \
-        CAT2(hash_table(K_T, V_T), _update_load_thresh)(t);                                  \
+        CAT2(hash_table(K_T, V_T), _alloc)(t, HT_MIN_CAP);                                   \
                                                                                              \
         return t;                                                                            \
-    }                                                                                        \
+    }
 
 #endif
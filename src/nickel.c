@@ -15,22 +15,233 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <sys/mman.h>
 #include <ctype.h>
 #include <stdarg.h>
 #include <time.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <malloc.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 
-#include "array.c"
-#include "hash_table.h"
+#include "probes.h"
+#include "simd.h"
+
+/* For the rarely used helpers of apply(), so that their locals don't bloat
+   its stack frame and with it the depth of recursion we can handle. */
+#define NOINLINE __attribute__((noinline))
+
+static void output_flush(void);
+static void flight_dump(void);
 
 #define ERROR(fmt, ...)                           \
 do {                                              \
+    output_flush();                               \
     printf("Nickel: error: " fmt, ##__VA_ARGS__); \
+    fflush(stdout);                               \
+    flight_dump();                                \
     exit(__LINE__);                               \
 } while (0)
 
 
 
+/*** Program output. Everything a Nickel program prints is collected here
+ *** and written out in large chunks (or line by line when stdout is a
+ *** terminal), so that we know exactly when output is flushed. ***/
+
+#define OUTPUT_BUF_LEN (1 << 16)
+
+static char   output_buf[OUTPUT_BUF_LEN];
+static size_t output_used;
+static int    output_is_tty;
+
+static int  trace;
+static void trace_flush(uint64_t start, size_t bytes);
+static uint64_t now_ns(void);
+
+static void output_emit(const char *p, size_t len) {
+    uint64_t start;
+    size_t   done;
+    ssize_t  n;
+
+    start = trace ? now_ns() : 0;
+
+    for (done = 0; done < len; done += n) {
+        n = write(1, p + done, len - done);
+        if (n < 0) { break; }
+    }
+
+    NK_PROBE1(output__flush, len);
+
+    if (trace) { trace_flush(start, len); }
+}
+
+static void output_flush(void) {
+    if (output_used == 0) { return; }
+
+    output_emit(output_buf, output_used);
+    output_used = 0;
+}
+
+static void output_write(const char *p, size_t n) {
+    if (output_used + n > OUTPUT_BUF_LEN) {
+        output_flush();
+        if (n > OUTPUT_BUF_LEN) {
+            output_emit(p, n);
+            return;
+        }
+    }
+
+    memcpy(output_buf + output_used, p, n);
+    output_used += n;
+
+    if (output_is_tty && memchr(p, '\n', n) != NULL) {
+        output_flush();
+    }
+}
+
+
+
+/*** Memory allocation. Everything the interpreter allocates goes through
+ *** these wrappers so that we can account for it. ***/
+
+#include "array.h"
+
+/* Running totals of every allocation made so far. */
+static uint64_t alloc_count;
+static uint64_t alloc_bytes;
+static uint64_t alloc_regrowths;
+
+/* The builtin or user function that allocations are attributed to, and the
+ * source line of the application being evaluated. */
+static const char            *current_site = "<parse>";
+static volatile sig_atomic_t  current_line;
+
+/* What an allocation is for, as far as the heap census is concerned. */
+enum {
+    HEAP_OTHER,
+    HEAP_LIST,      /* arrays of nodes: list children, arguments, bodies */
+    HEAP_CHARS,     /* character buffers, e.g. strings being formatted */
+    HEAP_STRING,
+    HEAP_NAME,
+    HEAP_SYMBOL,    /* keys of the function table */
+    HEAP_MAP,       /* map values (but not their slots) */
+    N_HEAP_KINDS,
+};
+
+static const char *heap_kind_names[] = {
+    "other", "list", "chars", "string", "name", "symbol", "map",
+};
+
+static int  alloc_stats;
+static void alloc_stats_alloc(void *p, size_t size);
+static void alloc_stats_free(void *p);
+
+static int  heap_census;
+static void heap_census_alloc(void *p, size_t size, int kind);
+static void heap_census_free(void *p);
+
+static uint64_t max_heap;
+static void     budget_heap_alloc(void *p);
+static void     budget_heap_free(void *p);
+
+static void *nk_malloc(size_t size, int kind) {
+    void *p;
+
+    alloc_count += 1;
+    alloc_bytes += size;
+
+    p = malloc(size);
+
+    NK_PROBE2(alloc, p, size);
+
+    if (alloc_stats) { alloc_stats_alloc(p, size);       }
+    if (heap_census) { heap_census_alloc(p, size, kind); }
+    if (max_heap)    { budget_heap_alloc(p);             }
+
+    return p;
+}
+
+static void nk_free(void *p) {
+    if (p == NULL) { return; }
+
+    NK_PROBE1(free, p);
+
+    if (alloc_stats) { alloc_stats_free(p); }
+    if (heap_census) { heap_census_free(p); }
+    if (max_heap)    { budget_heap_free(p); }
+
+    free(p);
+}
+
+/* Counted as one allocation, like the malloc and copy that it replaces. */
+static void *nk_realloc(void *old, size_t size, int kind) {
+    void *p;
+
+    alloc_count += 1;
+    alloc_bytes += size;
+
+    NK_PROBE1(free, old);
+
+    if (alloc_stats) { alloc_stats_free(old); }
+    if (heap_census) { heap_census_free(old); }
+    if (max_heap)    { budget_heap_free(old); }
+
+    p = realloc(old, size);
+
+    NK_PROBE2(alloc, p, size);
+
+    if (alloc_stats) { alloc_stats_alloc(p, size);       }
+    if (heap_census) { heap_census_alloc(p, size, kind); }
+    if (max_heap)    { budget_heap_alloc(p);             }
+
+    return p;
+}
+
+static int array_heap_kind(array_t *array);
+
+/* array.c only asks for memory for an array that already has data when it
+ * needs to grow it. */
+static void *nk_array_malloc(array_t *array, size_t size) {
+    if (array->data != NULL) { alloc_regrowths += 1; }
+
+    return nk_malloc(size, array_heap_kind(array));
+}
+
+static void *nk_array_realloc(array_t *array, void *ptr, size_t size) {
+    alloc_regrowths += 1;
+
+    return nk_realloc(ptr, size, array_heap_kind(array));
+}
+
+static char *nk_strndup(const char *s, size_t n, int kind) {
+    size_t  len;
+    char   *p;
+
+    len = strnlen(s, n);
+    p   = nk_malloc(len + 1, kind);
+    memcpy(p, s, len);
+    p[len] = 0;
+
+    return p;
+}
+
+static char *nk_strdup(const char *s, int kind) {
+    return nk_strndup(s, strlen(s), kind);
+}
+
+#define ARRAY_MALLOC(array, size)       (nk_array_malloc((array), (size)))
+#define ARRAY_REALLOC(array, ptr, size) (nk_array_realloc((array), (ptr), (size)))
+#define ARRAY_FREE(array, ptr)          (nk_free((ptr)))
+
+#include "array.c"
+#include "hash_table.h"
+
+
+
 /*** Define the kinds of syntax nodes our language contains. ***/
 enum {
     INVALID,
@@ -39,6 +250,7 @@ enum {
     INT_ATOM,
     STRING_ATOM,
     NAME_ATOM,
+    MAP,
 };
 
 typedef struct {
@@ -47,15 +259,102 @@ typedef struct {
         long long   integer;
         const char *string;
         const char *name;
+        struct Map *map;
         void       *_v;
     };
-    int kind;
+    int      kind;
+    unsigned loc;  /* index into `locs`, or 0 if the node has no position */
 } Node;
 
+/* Typed operations for the arrays that evaluation and printing spend their
+ * time in: lists of nodes and character buffers. */
+use_array(Node);
+use_array(char);
+
+#define NODES(op) array_call(Node, op)
+#define CHARS(op) array_call(char, op)
+
+/* Maps are keyed by integers and strings. A key carries its hash so that
+ * neither lookups nor resizes have to hash a string twice. */
+typedef struct {
+    union {
+        long long   integer;
+        const char *string;
+    };
+    int      kind;  /* INT_ATOM or STRING_ATOM */
+    uint64_t hash;
+} MapKey;
+
+static uint64_t map_key_hash(MapKey key) { return key.hash; }
+
+static int map_key_equ(MapKey a, MapKey b) {
+    if (a.hash != b.hash || a.kind != b.kind) { return 0; }
+
+    return a.kind == INT_ATOM ? a.integer == b.integer
+                              : strcmp(a.string, b.string) == 0;
+}
+
+use_hash_table_with(MapKey, Node, map_key_hash, map_key_equ);
+
+/* Unlike every other value, a map is shared rather than copied: copies of a
+ * map node all refer to the same Map, which is freed with the last of
+ * them. So a map that is put into itself is never freed. `printing` is set
+ * while the map is being printed, so that such a map prints as {...}
+ * where it contains itself instead of without end. */
+typedef struct Map {
+    uint64_t                 refs;
+    int                      printing;
+    hash_table(MapKey, Node) table;
+} Map;
+
+static void    map_release(Map *map);
+static array_t map_sorted_keys(Map *map);
 
 
 
 
+
+/* Arrays are tagged with their heap kind where they are made. */
+static int array_heap_kind(array_t *array) {
+    return array->tag;
+}
+
+
+
+/*** Source positions. The parser records where each node came from in a
+ *** side table so that Node itself doesn't grow. ***/
+
+typedef struct {
+    unsigned line;
+    unsigned col;
+} SrcLoc;
+
+static array_t locs;
+
+#define NODE_LINE(node) (((SrcLoc*)array_item(locs, (node)->loc))->line)
+
+
+
+/* Cheap counters that are always kept. See the "Runtime statistics"
+ * section below for how they are reported. */
+static struct {
+    uint64_t evals;
+    uint64_t applications;
+    uint64_t user_calls;
+    uint64_t copies;
+    uint64_t copied_nodes;
+    uint64_t copied_bytes;
+    uint64_t moves;
+    uint64_t peak_args_depth;
+    uint64_t peak_call_depth;
+    uint64_t source_bytes;
+    uint64_t parse_ns;
+    uint64_t eval_start_ns;
+    uint64_t eval_ns;
+} stats;
+
+
+
 /*** Utility functions to make/copy/free/print nodes ***/
 static Node make_node(int kind) {
     Node node;
@@ -65,7 +364,7 @@ static Node make_node(int kind) {
     node.kind = kind;
 
     if (kind == LIST || kind == PROGRAM) {
-        node.children = array_make(Node);
+        node.children = array_make_tagged(Node, HEAP_LIST);
     }
 
     return node;
@@ -88,7 +387,7 @@ static Node make_string(const char *s) {
     Node node;
 
     node        = make_node(STRING_ATOM);
-    node.string = strdup(s);
+    node.string = nk_strdup(s, HEAP_STRING);
 
     return node;
 }
@@ -102,178 +401,2013 @@ static Node make_string_no_dup(const char *s) {
     return node;
 }
 
-static Node make_name(const char *s) {
-    Node node;
+static Node make_name(const char *s) {
+    Node node;
+
+    node      = make_node(NAME_ATOM);
+    node.name = nk_strdup(s, HEAP_NAME);
+
+    return node;
+}
+
+static Node _copy_node(Node *node) {
+    Node  new;
+    Node *it;
+    Node  new_child;
+
+    stats.copied_nodes += 1;
+
+    switch (node->kind) {
+        case INT_ATOM:
+            new = make_int(node->integer);
+            break;
+        case STRING_ATOM:
+            new = make_string(node->string);
+            break;
+        case NAME_ATOM:
+            new = make_name(node->name);
+            break;
+        case MAP:
+            new            = make_node(MAP);
+            new.map        = node->map;
+            new.map->refs += 1;
+            break;
+        case LIST:
+            new = make_list();
+            array_traverse(node->children, it) {
+                new_child = _copy_node(it);
+                NODES(push)(&new.children, &new_child);
+            }
+            break;
+    }
+
+    new.loc = node->loc;
+
+    return new;
+}
+
+static Node copy_node(Node *node) {
+    Node     new;
+    uint64_t bytes;
+
+    bytes = alloc_bytes;
+    new   = _copy_node(node);
+
+    stats.copies       += 1;
+    stats.copied_bytes += alloc_bytes - bytes;
+
+    return new;
+}
+
+/* Take the value out of `node` without copying it. The node is left
+   INVALID, which free_node() skips, so whoever owned it can still free it
+   as usual. */
+static Node move_node(Node *node) {
+    Node moved;
+
+    moved      = *node;
+    node->kind = INVALID;
+
+    stats.moves += 1;
+
+    return moved;
+}
+
+static void free_node(Node *node) {
+    Node *it;
+
+    switch (node->kind) {
+        case PROGRAM:
+        case LIST:
+            array_traverse(node->children, it) {
+                free_node(it);
+            }
+            array_free(node->children);
+            break;
+        case INT_ATOM:
+            break;
+        case STRING_ATOM:
+            nk_free((char*)node->string);
+            break;
+        case NAME_ATOM:
+            nk_free((char*)node->name);
+            break;
+        case MAP:
+            map_release(node->map);
+            break;
+        default:
+            break;
+    }
+}
+
+static void _node_to_string(array_t *chars, Node *node) {
+    char     buff[32];
+    Node    *it;
+    array_t  keys;
+    MapKey  *key;
+
+#define PUSHC(c) { char _c = (c); CHARS(push)(chars, &_c); }
+#define PUSHS(s) { const char *_s=(s); CHARS(push_n)(chars, _s, strlen(_s)); }
+
+    switch (node->kind) {
+        case PROGRAM:
+            array_traverse(node->children, it) {
+                _node_to_string(chars, it);
+                PUSHC('\n');
+            }
+            break;
+        case LIST:
+            PUSHC('['); PUSHC(' ');
+            array_traverse(node->children, it) {
+                _node_to_string(chars, it);
+                PUSHC(' ');
+            }
+            PUSHC(']');
+            break;
+        case INT_ATOM:
+            snprintf(buff, sizeof(buff), "%lld", node->integer);
+            PUSHS(buff);
+            break;
+        case STRING_ATOM:
+            PUSHS(node->string);
+            break;
+        case NAME_ATOM:
+            PUSHS("<name ");
+            PUSHS(node->name);
+            PUSHC('>');
+            break;
+        case MAP:
+            if (node->map->printing) {
+                PUSHS("{...}");
+                break;
+            }
+            node->map->printing = 1;
+            keys = map_sorted_keys(node->map);
+            PUSHC('{'); PUSHC(' ');
+            array_traverse(keys, key) {
+                if (key->kind == INT_ATOM) {
+                    snprintf(buff, sizeof(buff), "%lld", key->integer);
+                    PUSHS(buff);
+                } else {
+                    PUSHS(key->string);
+                }
+                PUSHC(' ');
+                _node_to_string(chars, hash_table_get_val(node->map->table, *key));
+                PUSHC(' ');
+            }
+            PUSHC('}');
+            array_free(keys);
+            node->map->printing = 0;
+            break;
+        default:
+            break;
+    }
+}
+
+static char *node_to_string(Node *node) {
+    array_t chars;
+
+    chars = array_make_tagged(char, HEAP_CHARS);
+    _node_to_string(&chars, node);
+
+    array_zero_term(chars);
+
+    return array_data(chars);
+}
+
+static void print_node(Node *node) {
+    char *str;
+
+    str = node_to_string(node);
+    output_write(str, strlen(str));
+    output_write("\n", 1);
+    nk_free(str);
+}
+
+
+/*** Our top-level data: ***/
+
+/* The root node. */
+static Node program;
+
+/* Our place in the file we are currently parsing. */
+static const char *cursor;
+
+/* Current line number, and where that line starts. */
+static unsigned    line = 1;
+static const char *line_start;
+
+/* Set up some things for a hash_table, which we'll use as a symbol table. */
+static uint64_t str_hash(const char *s) { return simd_str_hash(s); }
+static int str_equ(const char *a, const char *b) { return strcmp(a, b) == 0; }
+typedef const char *fn_name_t;
+
+/* Per-function bookkeeping that outlives any single definition of the
+ * function. A redefinition inherits the FnInfo of the function it replaces,
+ * so these are created once per distinct name and never freed. */
+enum {
+    METRIC_NS,
+    METRIC_BYTES,
+    METRIC_CTR0,   /* the --perf-counters counters, in perf_ctrs order */
+    N_METRICS = METRIC_CTR0 + 4,
+};
+
+typedef struct {
+    const char *name;
+    int         id;
+    int         active;          /* live activations, so recursion isn't double counted */
+    uint64_t    calls;
+    uint64_t    incl[N_METRICS];
+    uint64_t    excl[N_METRICS];
+} FnInfo;
+
+/* All FnInfos, indexed by id. */
+static array_t fn_infos;
+
+typedef struct {
+    array_t  exprs;
+    FnInfo  *info;
+} Function;
+
+/* The function table is looked up on every application, so it has its hash
+   and equality functions built in and is called directly below. It resizes
+   incrementally, so that defining a function never stalls on moving all of
+   the others. */
+use_hash_table_with(fn_name_t, Function, str_hash, str_equ);
+
+#define FUNCTIONS(op) hash_table_call(fn_name_t, Function, op)
+
+/* Symbol table for user-defined functions */
+static hash_table(fn_name_t, Function) functions;
+
+/* An argument stack. */
+static array_t args;
+
+static FnInfo *fn_info_make(const char *name) {
+    FnInfo *info;
+
+    info       = calloc(1, sizeof(*info));
+    info->name = strdup(name);
+    info->id   = array_len(fn_infos);
+    array_push(fn_infos, info);
+
+    return info;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t u64_hash(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/* Write `s` as a JSON string literal. */
+static void json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s += 1) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(f, "\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+
+
+/*** Performance counters (--perf-counters). We open a group of hardware
+ *** counters with perf_event_open and read it whenever the profiler takes
+ *** a measurement. Where hardware counters aren't available (e.g. in many
+ *** containers and VMs), we fall back to software counters. ***/
+
+typedef struct {
+    const char *name;
+    uint32_t    type;
+    uint64_t    config;
+} PerfCtr;
+
+enum {
+    CTR_CYCLES,
+    CTR_INSTRUCTIONS,
+    CTR_CACHE_MISSES,
+    CTR_BRANCH_MISSES,
+};
+
+static PerfCtr perf_hw_ctrs[] = {
+    { "cycles",         PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES       },
+    { "instructions",   PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS     },
+    { "cache-misses",   PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES     },
+    { "branch-misses",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES    },
+};
+
+static PerfCtr perf_sw_ctrs[] = {
+    { "task-clock",     PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK       },
+    { "page-faults",    PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS      },
+    { "ctx-switches",   PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { "cpu-migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS   },
+};
+
+static int      perf_counters;
+static int      perf_hw;          /* whether we got the hardware counters */
+static int      perf_group = -1;
+static int      perf_n_ctrs;
+static PerfCtr *perf_ctrs[4];
+
+static int perf_open(PerfCtr *ctr, int group) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = ctr->type;
+    attr.config         = ctr->config;
+    attr.exclude_kernel = ctr->type == PERF_TYPE_HARDWARE;
+    attr.exclude_hv     = 1;
+    attr.read_format    = PERF_FORMAT_GROUP;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+/* Open as many of `ctrs` as we can as one group. The first must succeed. */
+static int perf_open_group(PerfCtr *ctrs, int n) {
+    int i;
+
+    perf_n_ctrs = 0;
+
+    if ((perf_group = perf_open(&ctrs[0], -1)) < 0) { return 0; }
+    perf_ctrs[perf_n_ctrs++] = &ctrs[0];
+
+    for (i = 1; i < n; i += 1) {
+        if (perf_open(&ctrs[i], perf_group) >= 0) {
+            perf_ctrs[perf_n_ctrs++] = &ctrs[i];
+        }
+    }
+
+    return 1;
+}
+
+static void perf_init(void) {
+    if (perf_open_group(perf_hw_ctrs, 4)) {
+        perf_hw = 1;
+    } else if (perf_open_group(perf_sw_ctrs, 4)) {
+        fprintf(stderr, "Nickel: hardware counters unavailable, using software counters\n");
+    } else {
+        fprintf(stderr, "Nickel: unable to open performance counters\n");
+        perf_counters = 0;
+    }
+}
+
+static void perf_read(uint64_t *ctrs) {
+    uint64_t buff[1 + 4];
+    int      i;
+
+    if (read(perf_group, buff, sizeof(buff)) < (ssize_t)sizeof(uint64_t)) { return; }
+
+    for (i = 0; i < perf_n_ctrs; i += 1) {
+        ctrs[i] = buff[1 + i];
+    }
+}
+
+/* Look up the exclusive count of one of the hardware counters, or 0 if we
+   don't have it. */
+static uint64_t perf_hw_excl(FnInfo *info, int which) {
+    int i;
+
+    for (i = 0; i < perf_n_ctrs; i += 1) {
+        if (perf_ctrs[i] == &perf_hw_ctrs[which]) {
+            return info->excl[METRIC_CTR0 + i];
+        }
+    }
+
+    return 0;
+}
+
+static double ratio(uint64_t a, uint64_t b) { return b ? (double)a / b : 0.0; }
+
+static void perf_report(array_t *sorted) {
+    FnInfo **it;
+    FnInfo  *info;
+    int      i;
+    uint64_t instrs;
+
+    fprintf(stderr, "\nPerformance counters (self):\n\n");
+
+    if (perf_hw) {
+        fprintf(stderr, "%14s %14s %7s %12s %12s %8s %8s  %s\n",
+                "cycles", "instructions", "IPC", "cache-miss", "branch-miss",
+                "c-MPKI", "b-MPKI", "name");
+    } else {
+        for (i = 0; i < perf_n_ctrs; i += 1) {
+            fprintf(stderr, "%14s ", perf_ctrs[i]->name);
+        }
+        fprintf(stderr, " name\n");
+    }
+
+    array_traverse(*sorted, it) {
+        info = *it;
+        if (info->calls == 0) { continue; }
+
+        if (perf_hw) {
+            instrs = perf_hw_excl(info, CTR_INSTRUCTIONS);
+            fprintf(stderr, "%14llu %14llu %7.2f %12llu %12llu %8.2f %8.2f  %s\n",
+                    (unsigned long long)perf_hw_excl(info, CTR_CYCLES),
+                    (unsigned long long)instrs,
+                    ratio(instrs, perf_hw_excl(info, CTR_CYCLES)),
+                    (unsigned long long)perf_hw_excl(info, CTR_CACHE_MISSES),
+                    (unsigned long long)perf_hw_excl(info, CTR_BRANCH_MISSES),
+                    1000.0 * ratio(perf_hw_excl(info, CTR_CACHE_MISSES), instrs),
+                    1000.0 * ratio(perf_hw_excl(info, CTR_BRANCH_MISSES), instrs),
+                    info->name);
+        } else {
+            for (i = 0; i < perf_n_ctrs; i += 1) {
+                fprintf(stderr, "%14llu ", (unsigned long long)info->excl[METRIC_CTR0 + i]);
+            }
+            fprintf(stderr, " %s\n", info->name);
+        }
+    }
+}
+
+
+
+/*** The call-graph profiler (--profile). For each user function we count
+ *** calls and measure inclusive and exclusive time and allocated bytes.
+ *** We also count the calls along every caller->callee edge. ***/
+
+static int         profile;
+static const char *profile_json_path = "nickel-profile.json";
+
+typedef struct {
+    FnInfo   *info;
+    uint64_t  start[N_METRICS];
+    uint64_t  child[N_METRICS];
+} ProfFrame;
+
+typedef struct {
+    uint64_t calls;
+    uint64_t ns;
+} ProfEdge;
+
+use_hash_table(uint64_t, ProfEdge);
+
+static array_t                        prof_frames;
+static hash_table(uint64_t, ProfEdge) prof_edges;
+static FnInfo                        *prof_toplevel;
+
+#define PROF_EDGE_KEY(caller, callee) \
+    (((uint64_t)(caller)->id << 32ULL) | (uint64_t)(callee)->id)
+
+static void prof_read_metrics(uint64_t *m) {
+    if (perf_counters) { perf_read(m + METRIC_CTR0); }
+
+    m[METRIC_NS]    = now_ns();
+    m[METRIC_BYTES] = alloc_bytes;
+}
+
+static void prof_enter(FnInfo *info) {
+    ProfFrame *frame;
+
+    frame = array_next_elem(prof_frames);
+
+    frame->info = info;
+    memset(frame->child, 0, sizeof(frame->child));
+
+    info->active += 1;
+    prof_read_metrics(frame->start);
+}
+
+static void prof_leave(void) {
+    uint64_t   now[N_METRICS];
+    ProfFrame *frame;
+    ProfFrame *parent;
+    FnInfo    *caller;
+    int        i;
+    uint64_t   d;
+    uint64_t   key;
+    ProfEdge  *edge;
+    ProfEdge   new_edge;
+
+    prof_read_metrics(now);
+
+    frame  = array_last(prof_frames);
+    parent = array_len(prof_frames) > 1 ? frame - 1 : NULL;
+    caller = parent ? parent->info : prof_toplevel;
+
+    frame->info->calls  += 1;
+    frame->info->active -= 1;
+
+    for (i = 0; i < N_METRICS; i += 1) {
+        d = now[i] - frame->start[i];
+
+        frame->info->excl[i] += d - frame->child[i];
+        if (frame->info->active == 0) {
+            frame->info->incl[i] += d;
+        }
+        if (parent != NULL) {
+            parent->child[i] += d;
+        }
+    }
+
+    key  = PROF_EDGE_KEY(caller, frame->info);
+    edge = hash_table_get_val(prof_edges, key);
+    if (edge == NULL) {
+        memset(&new_edge, 0, sizeof(new_edge));
+        hash_table_insert(prof_edges, key, new_edge);
+        edge = hash_table_get_val(prof_edges, key);
+    }
+    edge->calls += 1;
+    if (frame->info->active == 0) {
+        edge->ns += now[METRIC_NS] - frame->start[METRIC_NS];
+    }
+
+    array_pop(prof_frames);
+}
+
+static int prof_cmp_excl(const void *a, const void *b) {
+    const FnInfo *fa;
+    const FnInfo *fb;
+
+    fa = *(FnInfo**)a;
+    fb = *(FnInfo**)b;
+
+    if (fa->excl[METRIC_NS] == fb->excl[METRIC_NS]) { return strcmp(fa->name, fb->name); }
+    return fa->excl[METRIC_NS] < fb->excl[METRIC_NS] ? 1 : -1;
+}
+
+static void prof_report(void) {
+    array_t    sorted;
+    FnInfo   **it;
+    FnInfo    *info;
+    uint64_t   total_ns;
+    uint64_t   key;
+    ProfEdge  *edge;
+    FnInfo    *caller;
+    FnInfo    *callee;
+    FILE      *f;
+    int        first;
+    int        i;
+
+    /* Close any frames that are still open, e.g. because of an error. */
+    while (array_len(prof_frames) > 0) {
+        prof_leave();
+    }
+
+    output_flush();
+
+    sorted = array_make(FnInfo*);
+    array_copy(sorted, fn_infos);
+    qsort(array_data(sorted), array_len(sorted), sizeof(FnInfo*), prof_cmp_excl);
+
+    total_ns = 0;
+    array_traverse(sorted, it) {
+        total_ns += (*it)->excl[METRIC_NS];
+    }
+    if (total_ns == 0) { total_ns = 1; }
+
+    fprintf(stderr, "\nFlat profile (sorted by self time):\n\n");
+    fprintf(stderr, "%7s %12s %12s %10s %12s %14s %14s  %s\n",
+            "%time", "self ms", "total ms", "calls", "self us/call",
+            "self bytes", "total bytes", "name");
+    array_traverse(sorted, it) {
+        info = *it;
+        if (info->calls == 0) { continue; }
+        fprintf(stderr, "%7.2f %12.3f %12.3f %10llu %12.3f %14llu %14llu  %s\n",
+                100.0 * info->excl[METRIC_NS] / total_ns,
+                info->excl[METRIC_NS] / 1e6,
+                info->incl[METRIC_NS] / 1e6,
+                (unsigned long long)info->calls,
+                info->excl[METRIC_NS] / 1e3 / info->calls,
+                (unsigned long long)info->excl[METRIC_BYTES],
+                (unsigned long long)info->incl[METRIC_BYTES],
+                info->name);
+    }
+
+    if (perf_counters) { perf_report(&sorted); }
+
+    fprintf(stderr, "\nCall graph (caller -> callee):\n\n");
+    fprintf(stderr, "%10s %12s  %s\n", "calls", "total ms", "edge");
+    hash_table_traverse(prof_edges, key, edge) {
+        caller = *(FnInfo**)array_item(fn_infos, key >> 32ULL);
+        callee = *(FnInfo**)array_item(fn_infos, key & 0xFFFFFFFFULL);
+        fprintf(stderr, "%10llu %12.3f  %s -> %s\n",
+                (unsigned long long)edge->calls, edge->ns / 1e6,
+                caller->name, callee->name);
+    }
+
+    if ((f = fopen(profile_json_path, "w")) == NULL) {
+        fprintf(stderr, "Nickel: unable to write profile to '%s'\n", profile_json_path);
+        array_free(sorted);
+        return;
+    }
+
+    fprintf(f, "{\n  \"functions\": [");
+    first = 1;
+    array_traverse(sorted, it) {
+        info = *it;
+        if (info->calls == 0) { continue; }
+        fprintf(f, "%s\n    {\"name\": ", first ? "" : ",");
+        json_string(f, info->name);
+        fprintf(f, ", \"calls\": %llu, \"self_ns\": %llu, \"total_ns\": %llu"
+                   ", \"self_bytes\": %llu, \"total_bytes\": %llu",
+                (unsigned long long)info->calls,
+                (unsigned long long)info->excl[METRIC_NS],
+                (unsigned long long)info->incl[METRIC_NS],
+                (unsigned long long)info->excl[METRIC_BYTES],
+                (unsigned long long)info->incl[METRIC_BYTES]);
+        if (perf_counters) {
+            fprintf(f, ", \"counters\": {");
+            for (i = 0; i < perf_n_ctrs; i += 1) {
+                fprintf(f, "%s\"%s\": {\"self\": %llu, \"total\": %llu}",
+                        i ? ", " : "", perf_ctrs[i]->name,
+                        (unsigned long long)info->excl[METRIC_CTR0 + i],
+                        (unsigned long long)info->incl[METRIC_CTR0 + i]);
+            }
+            fprintf(f, "}");
+        }
+        fprintf(f, "}");
+        first = 0;
+    }
+    fprintf(f, "\n  ],\n  \"edges\": [");
+    first = 1;
+    hash_table_traverse(prof_edges, key, edge) {
+        caller = *(FnInfo**)array_item(fn_infos, key >> 32ULL);
+        callee = *(FnInfo**)array_item(fn_infos, key & 0xFFFFFFFFULL);
+        fprintf(f, "%s\n    {\"caller\": ", first ? "" : ",");
+        json_string(f, caller->name);
+        fprintf(f, ", \"callee\": ");
+        json_string(f, callee->name);
+        fprintf(f, ", \"calls\": %llu, \"total_ns\": %llu}",
+                (unsigned long long)edge->calls, (unsigned long long)edge->ns);
+        first = 0;
+    }
+    fprintf(f, "\n  ]\n}\n");
+    fclose(f);
+
+    fprintf(stderr, "\nProfile written to '%s'.\n", profile_json_path);
+
+    array_free(sorted);
+}
+
+static void prof_init(void) {
+    if (perf_counters) { perf_init(); }
+
+    prof_frames   = array_make(ProfFrame);
+    prof_edges    = hash_table_make(uint64_t, ProfEdge, u64_hash);
+    prof_toplevel = fn_info_make("<toplevel>");
+
+    atexit(prof_report);
+}
+
+
+
+/*** The shadow stack. The evaluator keeps the names of the active user
+ *** functions here, along with the line each was called from, so that they
+ *** can be read at any moment, including from a signal handler. Frames
+ *** deeper than SHADOW_STACK_MAX are counted but not recorded. ***/
+
+#define SHADOW_STACK_MAX (4096)
+
+static const char   *volatile shadow_stack[SHADOW_STACK_MAX];
+static volatile unsigned      shadow_call_lines[SHADOW_STACK_MAX];
+static volatile sig_atomic_t  shadow_depth;
+
+static inline void shadow_push(FnInfo *info) {
+    if (shadow_depth < SHADOW_STACK_MAX) {
+        shadow_stack[shadow_depth]      = info->name;
+        shadow_call_lines[shadow_depth] = current_line;
+    }
+    shadow_depth += 1;
+}
+
+static inline void shadow_pop(void) {
+    shadow_depth -= 1;
+    if (shadow_depth < SHADOW_STACK_MAX) {
+        current_line = shadow_call_lines[shadow_depth];
+    }
+}
+
+/* The line that frame `i` is currently executing. Frame -1 is the top
+   level. */
+static inline unsigned shadow_line(int i, int depth) {
+    if (i + 1 < depth && i + 1 < SHADOW_STACK_MAX) {
+        return shadow_call_lines[i + 1];
+    }
+    return current_line;
+}
+
+
+
+/*** The flight recorder. The evaluator always logs its most recent events
+ *** (calls, returns, builtins and defines) into a small ring buffer. When
+ *** ERROR fires or the process dies on a fatal signal, we dump the ring
+ *** along with the current call stack and its argument frames to stderr.
+ *** Names are copied into the ring since the strings they come from may
+ *** be freed long before the dump. The dump only uses write(2) so that it
+ *** is safe to run from a signal handler. ***/
+
+#define FLIGHT_RING_LEN   (256)   /* must be a power of two */
+#define FLIGHT_NAME_LEN   (24)
+#define FLIGHT_MAX_FRAMES (16)
+#define FLIGHT_MAX_ELEMS  (8)
+#define FLIGHT_MAX_NEST   (3)
+
+enum {
+    FLIGHT_BUILTIN,
+    FLIGHT_CALL,
+    FLIGHT_RETURN,
+    FLIGHT_DEFINE,
+};
+
+static const char *flight_kind_names[] = {
+    "builtin", "call", "return", "define",
+};
+
+typedef struct {
+    unsigned char kind;
+    unsigned char arity;          /* saturates at 255 */
+    unsigned      line;
+    unsigned      depth;
+    char          name[FLIGHT_NAME_LEN];
+} FlightEvent;
+
+static FlightEvent             flight_ring[FLIGHT_RING_LEN];
+static volatile uint64_t       flight_head;
+static volatile sig_atomic_t   flight_dumping;
+
+static inline void flight_record(int kind, const char *name, int arity) {
+    FlightEvent *ev;
+    int          i;
+
+    ev        = &flight_ring[flight_head & (FLIGHT_RING_LEN - 1)];
+    ev->kind  = kind;
+    ev->arity = arity > 255 ? 255 : arity;
+    ev->line  = current_line;
+    ev->depth = shadow_depth;
+    for (i = 0; i < FLIGHT_NAME_LEN - 1 && name[i]; i += 1) {
+        ev->name[i] = name[i];
+    }
+    ev->name[i] = 0;
+
+    flight_head += 1;
+}
+
+/* The application we just recorded as a builtin turned out to be a call to
+   a user function. */
+static inline void flight_mark_call(void) {
+    flight_ring[(flight_head - 1) & (FLIGHT_RING_LEN - 1)].kind = FLIGHT_CALL;
+    flight_ring[(flight_head - 1) & (FLIGHT_RING_LEN - 1)].depth = shadow_depth;
+}
+
+/* A tiny buffered writer for stderr that doesn't allocate. */
+static char   flight_out[4096];
+static size_t flight_out_len;
+
+static void flight_flush(void) {
+    ssize_t n;
+    size_t  off;
+
+    for (off = 0; off < flight_out_len; off += n) {
+        if ((n = write(2, flight_out + off, flight_out_len - off)) <= 0) { break; }
+    }
+    flight_out_len = 0;
+}
+
+static void flight_puts(const char *s) {
+    while (*s) {
+        if (flight_out_len == sizeof(flight_out)) { flight_flush(); }
+        flight_out[flight_out_len++] = *s++;
+    }
+}
+
+static void flight_puti(long long i) {
+    char               buf[24];
+    char              *p;
+    unsigned long long u;
+
+    p  = buf + sizeof(buf);
+    *--p = 0;
+    u  = i < 0 ? -(unsigned long long)i : (unsigned long long)i;
+    do { *--p = '0' + u % 10; u /= 10; } while (u);
+    if (i < 0) { *--p = '-'; }
+
+    flight_puts(p);
+}
+
+static void flight_put_node(Node *node, int nest) {
+    Node *it;
+    int   n;
+    char  c[2];
+
+    switch (node->kind) {
+        case INT_ATOM:    flight_puti(node->integer); break;
+        case NAME_ATOM:   flight_puts(node->name);    break;
+        case MAP:
+            flight_puts("{map of ");
+            flight_puti(hash_table_len(node->map->table));
+            flight_puts("}");
+            break;
+        case STRING_ATOM:
+            flight_puts("\"");
+            for (n = 0; node->string[n] && n < 32; n += 1) {
+                c[0] = node->string[n] == '\n' ? ' ' : node->string[n];
+                c[1] = 0;
+                flight_puts(c);
+            }
+            flight_puts(node->string[n] ? "...\"" : "\"");
+            break;
+        case LIST:
+            if (nest >= FLIGHT_MAX_NEST) { flight_puts("[...]"); break; }
+            flight_puts("[");
+            n = 0;
+            array_traverse(node->children, it) {
+                if (n == FLIGHT_MAX_ELEMS) {
+                    flight_puts(" ... (");
+                    flight_puti(array_len(node->children));
+                    flight_puts(" items)");
+                    break;
+                }
+                flight_puts(" ");
+                flight_put_node(it, nest + 1);
+                n += 1;
+            }
+            flight_puts(" ]");
+            break;
+        default:
+            flight_puts("?");
+    }
+}
+
+static void flight_dump(void) {
+    uint64_t     head;
+    uint64_t     i;
+    FlightEvent *ev;
+    int          depth;
+    int          frame;
+    array_t     *frame_args;
+    Node        *it;
+
+    head  = flight_head;
+    depth = array_len(args);
+
+    if ((head == 0 && depth == 0) || flight_dumping) { return; }
+    flight_dumping = 1;
+
+    flight_puts("\n--- Nickel flight recorder: last ");
+    flight_puti(head < FLIGHT_RING_LEN ? head : FLIGHT_RING_LEN);
+    flight_puts(" of ");
+    flight_puti(head);
+    flight_puts(" events ---\n");
+    for (i = head < FLIGHT_RING_LEN ? 0 : head - FLIGHT_RING_LEN; i < head; i += 1) {
+        ev = &flight_ring[i & (FLIGHT_RING_LEN - 1)];
+        flight_puts("  line ");
+        flight_puti(ev->line);
+        flight_puts("\t");
+        flight_puts(flight_kind_names[ev->kind]);
+        flight_puts("\t");
+        for (frame = 0; frame < (int)ev->depth && frame < 32; frame += 1) {
+            flight_puts(" ");
+        }
+        flight_puts(ev->name);
+        if (ev->kind == FLIGHT_BUILTIN || ev->kind == FLIGHT_CALL) {
+            flight_puts("/");
+            flight_puti(ev->arity);
+        }
+        flight_puts("\n");
+    }
+
+    flight_puts("--- call stack, innermost first (");
+    flight_puti(depth);
+    flight_puts(" frames) ---\n");
+    for (frame = depth - 1; frame >= 0 && frame >= depth - FLIGHT_MAX_FRAMES; frame -= 1) {
+        frame_args = (array_t*)array_item(args, frame);
+        flight_puts("  #");
+        flight_puti(depth - 1 - frame);
+        flight_puts(" line ");
+        flight_puti(shadow_line(frame, shadow_depth));
+        flight_puts("\t[");
+        array_traverse(*frame_args, it) {
+            if (it != array_item(*frame_args, 0)) { flight_puts(" "); }
+            flight_put_node(it, 0);
+        }
+        flight_puts("]\n");
+    }
+    if (depth > FLIGHT_MAX_FRAMES) {
+        flight_puts("  ... ");
+        flight_puti(depth - FLIGHT_MAX_FRAMES);
+        flight_puts(" more frames\n");
+    }
+    flight_puts("  (toplevel) line ");
+    flight_puti(shadow_line(-1, shadow_depth));
+    flight_puts("\n");
+
+    flight_flush();
+}
+
+static void flight_signal_handler(int sig) {
+    flight_puts("Nickel: fatal signal ");
+    flight_puti(sig);
+    flight_puts(" (");
+    flight_puts(sig == SIGSEGV ? "segmentation fault, possibly a stack overflow"
+              : sig == SIGFPE  ? "arithmetic error"
+              : sig == SIGBUS  ? "bus error"
+              : sig == SIGILL  ? "illegal instruction"
+              :                  "abort");
+    flight_puts(")\n");
+    flight_flush();
+    flight_dump();
+
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void flight_init(void) {
+    static char      alt_stack[1 << 16];
+    stack_t          ss;
+    struct sigaction sa;
+    int              sigs[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+    unsigned         i;
+
+    /* Run the handler on its own stack so that we can report overflows of
+       the main one. */
+    ss.ss_sp    = alt_stack;
+    ss.ss_size  = sizeof(alt_stack);
+    ss.ss_flags = 0;
+    sigaltstack(&ss, NULL);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = flight_signal_handler;
+    sa.sa_flags   = SA_ONSTACK | SA_RESETHAND;
+    sigemptyset(&sa.sa_mask);
+    for (i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i += 1) {
+        sigaction(sigs[i], &sa, NULL);
+    }
+}
+
+
+
+/*** The sampling profiler (--sample HZ). SIGPROF fires HZ times per second
+ *** of CPU time and the handler copies the shadow stack into a preallocated
+ *** buffer. The evaluator periodically drains that buffer into a table of
+ *** folded stacks, which is written out at exit in the format expected by
+ *** flamegraph.pl. ***/
+
+#define SAMPLE_BUF_LEN    (1 << 16)
+#define SAMPLE_MAX_FRAMES (512)
+
+static int         sample_hz;
+static const char *sample_path = "nickel-samples.folded";
+
+/* Each sample is stored as its frame count, the line being executed at the
+   top level, and then a name and line for each frame. */
+static const char            **sample_buf;
+static volatile sig_atomic_t   sample_used;
+static volatile sig_atomic_t   sample_dropped;
+
+use_hash_table(fn_name_t, uint64_t);
+
+static hash_table(fn_name_t, uint64_t) sample_stacks;
+static array_t                         sample_chars;
+
+static void sample_handler(int sig) {
+    int depth;
+    int n;
+    int start;
+    int i;
+    int used;
+
+    (void)sig;
+
+    depth = shadow_depth;
+    if (depth > SHADOW_STACK_MAX) { depth = SHADOW_STACK_MAX; }
+
+    n     = depth < SAMPLE_MAX_FRAMES ? depth : SAMPLE_MAX_FRAMES;
+    start = depth - n;
+    used  = sample_used;
+
+    if (used + 2 + 2 * n > SAMPLE_BUF_LEN) {
+        sample_dropped += 1;
+        return;
+    }
+
+    /* Keep the leaf-most frames of very deep stacks. A negative count marks
+       a truncated sample. */
+    sample_buf[used]     = (const char*)(intptr_t)(start > 0 ? -n : n);
+    sample_buf[used + 1] = (const char*)(intptr_t)shadow_line(-1, shadow_depth);
+    for (i = 0; i < n; i += 1) {
+        sample_buf[used + 2 + 2 * i]     = shadow_stack[start + i];
+        sample_buf[used + 2 + 2 * i + 1] = (const char*)(intptr_t)shadow_line(start + i, shadow_depth);
+    }
+
+    sample_used = used + 2 + 2 * n;
+}
+
+static void sample_drain(void) {
+    sigset_t     set;
+    sigset_t     old;
+    int          i;
+    intptr_t     n;
+    int          j;
+    const char  *s;
+    char         buff[64];
+    char         nul;
+    uint64_t    *count;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGPROF);
+    sigprocmask(SIG_BLOCK, &set, &old);
+
+    nul = 0;
+
+    for (i = 0; i < sample_used; i += 2 + 2 * (n < 0 ? -n : n)) {
+        n = (intptr_t)sample_buf[i];
+
+        array_clear(sample_chars);
+
+        if (n < 0) {
+            snprintf(buff, sizeof(buff), "<toplevel>;[truncated]");
+        } else {
+            snprintf(buff, sizeof(buff), "<toplevel>:%u", (unsigned)(intptr_t)sample_buf[i + 1]);
+        }
+        array_push_n(sample_chars, buff, strlen(buff));
+
+        for (j = 0; j < (n < 0 ? -n : n); j += 1) {
+            s = sample_buf[i + 2 + 2 * j];
+            snprintf(buff, sizeof(buff), ":%u", (unsigned)(intptr_t)sample_buf[i + 2 + 2 * j + 1]);
+            array_push_n(sample_chars, ";", 1);
+            array_push_n(sample_chars, (void*)s, strlen(s));
+            array_push_n(sample_chars, buff, strlen(buff));
+        }
+        array_push(sample_chars, nul);
+
+        count = hash_table_get_val(sample_stacks, array_data(sample_chars));
+        if (count != NULL) {
+            *count += 1;
+        } else {
+            hash_table_insert(sample_stacks, strdup(array_data(sample_chars)), 1);
+        }
+    }
+
+    sample_used = 0;
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+static inline void sample_maybe_drain(void) {
+    if (sample_used > SAMPLE_BUF_LEN / 2) {
+        sample_drain();
+    }
+}
+
+static void sample_report(void) {
+    struct itimerval  timer;
+    FILE             *f;
+    const char       *stack;
+    uint64_t         *count;
+    uint64_t          total;
+
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+
+    sample_drain();
+
+    if ((f = fopen(sample_path, "w")) == NULL) {
+        fprintf(stderr, "Nickel: unable to write samples to '%s'\n", sample_path);
+        return;
+    }
+
+    total = 0;
+    hash_table_traverse(sample_stacks, stack, count) {
+        fprintf(f, "%s %llu\n", stack, (unsigned long long)*count);
+        total += *count;
+    }
+
+    fclose(f);
+
+    output_flush();
+    fprintf(stderr, "\nNickel: %llu samples (%d dropped) written to '%s'.\n",
+            (unsigned long long)total, (int)sample_dropped, sample_path);
+}
+
+static void sample_init(void) {
+    struct sigaction  sa;
+    struct itimerval  timer;
+    long              usec;
+
+    sample_buf    = malloc(SAMPLE_BUF_LEN * sizeof(*sample_buf));
+    sample_stacks = hash_table_make_e(fn_name_t, uint64_t, str_hash, str_equ);
+    sample_chars  = array_make(char);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sample_handler;
+    sa.sa_flags   = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+
+    usec = 1000000 / sample_hz;
+    if (usec < 1) { usec = 1; }
+
+    memset(&timer, 0, sizeof(timer));
+    timer.it_interval.tv_sec  = usec / 1000000;
+    timer.it_interval.tv_usec = usec % 1000000;
+    timer.it_value            = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+
+    atexit(sample_report);
+}
+
+
+
+/*** Allocation sites. Both --alloc-stats and --heap-census attribute
+ *** allocations to `current_site`, which we intern here. ***/
+
+typedef struct {
+    const char *name;
+    unsigned    line;
+    uint64_t    count;
+    uint64_t    bytes;
+    uint64_t    live_count;
+    uint64_t    live_bytes;
+} Site;
+
+typedef Site *site_ptr_t;
+
+use_hash_table(fn_name_t, site_ptr_t);
+
+static hash_table(fn_name_t, site_ptr_t) sites;
+
+/* One-entry cache of the last site we looked up. `current_site` is often a
+   name from a node that is freed later, so compare contents as well. */
+static const char *last_site_name;
+static Site       *last_site;
+
+/* Sites are keyed on "name:line". */
+static Site *site_get(void) {
+    char        key[256];
+    site_ptr_t *lookup;
+    Site       *site;
+
+    if (last_site != NULL
+    &&  current_site == last_site_name
+    &&  (unsigned)current_line == last_site->line
+    &&  strcmp(current_site, last_site->name) == 0) {
+        return last_site;
+    }
+
+    snprintf(key, sizeof(key), "%s:%u", current_site, (unsigned)current_line);
+
+    lookup = hash_table_get_val(sites, key);
+    if (lookup != NULL) {
+        site = *lookup;
+    } else {
+        site       = calloc(1, sizeof(*site));
+        site->name = strdup(current_site);
+        site->line = current_line;
+        hash_table_insert(sites, strdup(key), site);
+    }
+
+    last_site_name = current_site;
+    last_site      = site;
+
+    return site;
+}
+
+static void sites_init(void) {
+    if (sites == NULL) {
+        sites = hash_table_make_e(fn_name_t, site_ptr_t, str_hash, str_equ);
+    }
+}
+
+/* Collect every site into an array of Site*, sorted by `cmp`, and leave
+   its length in *n. The array comes from plain malloc: an allocation
+   through nk_malloc would intern a site, which may grow `sites` while we
+   walk it. Free it with free(). */
+static Site **sites_sorted(int (*cmp)(const void*, const void*), uint64_t *n) {
+    Site       **sorted;
+    const char  *name;
+    site_ptr_t  *site;
+
+    sorted = malloc((hash_table_len(sites) + 1) * sizeof(Site*));
+    *n     = 0;
+    hash_table_traverse(sites, name, site) {
+        (void)name;
+        sorted[(*n)++] = *site;
+    }
+    qsort(sorted, *n, sizeof(Site*), cmp);
+
+    return sorted;
+}
+
+
+
+/*** Allocation statistics (--alloc-stats). Every allocation made through
+ *** nk_malloc is attributed to its site, and we keep a histogram of
+ *** allocation sizes and track peak live bytes. ***/
+
+#define ALLOC_HIST_BUCKETS (64)
+
+static uint64_t alloc_frees;
+static uint64_t alloc_live;
+static uint64_t alloc_peak_live;
+static uint64_t alloc_hist[ALLOC_HIST_BUCKETS];
+
+static void alloc_stats_alloc(void *p, size_t size) {
+    Site *site;
+
+    alloc_live += malloc_usable_size(p);
+    if (alloc_live > alloc_peak_live) {
+        alloc_peak_live = alloc_live;
+    }
+
+    alloc_hist[size ? 64 - __builtin_clzll(size) : 0] += 1;
+
+    site         = site_get();
+    site->count += 1;
+    site->bytes += size;
+}
+
+static void alloc_stats_free(void *p) {
+    alloc_frees += 1;
+    alloc_live  -= malloc_usable_size(p);
+}
+
+static int site_cmp_bytes(const void *a, const void *b) {
+    const Site *sa;
+    const Site *sb;
+
+    sa = *(Site**)a;
+    sb = *(Site**)b;
+
+    if (sa->bytes == sb->bytes) { return strcmp(sa->name, sb->name) ?: (int)sa->line - (int)sb->line; }
+    return sa->bytes < sb->bytes ? 1 : -1;
+}
+
+static void alloc_report(void) {
+    Site     **sorted;
+    Site     **it;
+    uint64_t   n;
+    int        i;
+    int        max_bucket;
+
+    alloc_stats = 0;
+
+    output_flush();
+
+    fprintf(stderr, "\nAllocation statistics:\n\n");
+    fprintf(stderr, "  allocations      %llu\n", (unsigned long long)alloc_count);
+    fprintf(stderr, "  frees            %llu\n", (unsigned long long)alloc_frees);
+    fprintf(stderr, "  bytes allocated  %llu\n", (unsigned long long)alloc_bytes);
+    fprintf(stderr, "  peak live bytes  %llu\n", (unsigned long long)alloc_peak_live);
+    fprintf(stderr, "  live at exit     %llu\n", (unsigned long long)alloc_live);
+    fprintf(stderr, "  array regrowths  %llu\n", (unsigned long long)alloc_regrowths);
+
+    fprintf(stderr, "\nAllocation sizes:\n\n");
+    max_bucket = 0;
+    for (i = 0; i < ALLOC_HIST_BUCKETS; i += 1) {
+        if (alloc_hist[i]) { max_bucket = i; }
+    }
+    for (i = 0; i <= max_bucket; i += 1) {
+        fprintf(stderr, "  %12llu - %-12llu %12llu\n",
+                i ? 1ULL << (i - 1) : 0ULL,
+                i ? (1ULL << i) - 1 : 0ULL,
+                (unsigned long long)alloc_hist[i]);
+    }
+
+    sorted = sites_sorted(site_cmp_bytes, &n);
+
+    fprintf(stderr, "\nAllocations by site:\n\n");
+    fprintf(stderr, "%12s %14s %10s %6s  %s\n", "count", "bytes", "avg", "line", "site");
+    for (it = sorted; it < sorted + n; it += 1) {
+        if ((*it)->count == 0) { continue; }
+        fprintf(stderr, "%12llu %14llu %10.1f %6u  %s\n",
+                (unsigned long long)(*it)->count,
+                (unsigned long long)(*it)->bytes,
+                (double)(*it)->bytes / (*it)->count,
+                (*it)->line,
+                (*it)->name);
+    }
+
+    free(sorted);
+}
+
+static void alloc_stats_init(void) {
+    sites_init();
+    alloc_stats = 1;
+
+    atexit(alloc_report);
+}
+
+
+
+/*** The heap census (--heap-census). We remember every live allocation
+ *** along with its kind and site so that we can report what is holding
+ *** memory, either on demand with [heap-report] or at exit. ***/
+
+typedef struct {
+    uint64_t  size;
+    int       kind;
+    Site     *site;
+} HeapObj;
+
+use_hash_table(uint64_t, HeapObj);
+
+static hash_table(uint64_t, HeapObj) heap_objs;
+
+static void heap_census_alloc(void *p, size_t size, int kind) {
+    HeapObj obj;
+
+    obj.size = size;
+    obj.kind = kind;
+    obj.site = site_get();
+
+    hash_table_insert(heap_objs, (uint64_t)p, obj);
+}
+
+static void heap_census_free(void *p) {
+    hash_table_delete(heap_objs, (uint64_t)p);
+}
+
+static int site_cmp_live_bytes(const void *a, const void *b) {
+    const Site *sa;
+    const Site *sb;
+
+    sa = *(Site**)a;
+    sb = *(Site**)b;
+
+    if (sa->live_bytes == sb->live_bytes) { return strcmp(sa->name, sb->name) ?: (int)sa->line - (int)sb->line; }
+    return sa->live_bytes < sb->live_bytes ? 1 : -1;
+}
+
+static void heap_report(const char *when) {
+    uint64_t     kind_count[N_HEAP_KINDS];
+    uint64_t     kind_bytes[N_HEAP_KINDS];
+    uint64_t     total_count;
+    uint64_t     total_bytes;
+    const char  *name;
+    site_ptr_t  *site;
+    uint64_t     p;
+    HeapObj     *obj;
+    Site       **sorted;
+    Site       **it;
+    uint64_t     n;
+    int          i;
+
+    memset(kind_count, 0, sizeof(kind_count));
+    memset(kind_bytes, 0, sizeof(kind_bytes));
+    total_count = total_bytes = 0;
+
+    hash_table_traverse(sites, name, site) {
+        (void)name;
+        (*site)->live_count = (*site)->live_bytes = 0;
+    }
+
+    hash_table_traverse(heap_objs, p, obj) {
+        (void)p;
+        kind_count[obj->kind]  += 1;
+        kind_bytes[obj->kind]  += obj->size;
+        obj->site->live_count  += 1;
+        obj->site->live_bytes  += obj->size;
+        total_count            += 1;
+        total_bytes            += obj->size;
+    }
+
+    output_flush();
+
+    fprintf(stderr, "\nHeap census (%s): %llu live objects, %llu bytes\n\n", when,
+            (unsigned long long)total_count, (unsigned long long)total_bytes);
+    fprintf(stderr, "%12s %14s  %s\n", "objects", "bytes", "kind");
+    for (i = 0; i < N_HEAP_KINDS; i += 1) {
+        if (kind_count[i] == 0) { continue; }
+        fprintf(stderr, "%12llu %14llu  %s\n",
+                (unsigned long long)kind_count[i],
+                (unsigned long long)kind_bytes[i],
+                heap_kind_names[i]);
+    }
+
+    sorted = sites_sorted(site_cmp_live_bytes, &n);
+
+    fprintf(stderr, "\n%12s %14s %6s  %s\n", "objects", "bytes", "line", "site");
+    for (it = sorted; it < sorted + n; it += 1) {
+        if ((*it)->live_count == 0) { continue; }
+        fprintf(stderr, "%12llu %14llu %6u  %s\n",
+                (unsigned long long)(*it)->live_count,
+                (unsigned long long)(*it)->live_bytes,
+                (*it)->line,
+                (*it)->name);
+    }
+
+    free(sorted);
+}
+
+static void heap_report_at_exit(void) {
+    heap_report("at exit");
+    heap_census = 0;
+}
+
+static void heap_census_init(void) {
+    sites_init();
+    heap_objs   = hash_table_make(uint64_t, HeapObj, u64_hash);
+    heap_census = 1;
+
+    atexit(heap_report_at_exit);
+}
+
+
+
+/*** The line profiler (--line-profile). We count how many times the list on
+ *** each source line is applied and how much time is spent there, then
+ *** write out an annotated copy of the source with the hot lines marked. ***/
+
+/* Lines that take at least this share of the total self time are hot. */
+#define LPROF_HOT_PERCENT (5.0)
+
+static int         line_profile;
+static const char *line_profile_path = "nickel-lines.txt";
+static const char *source_path;
+
+typedef struct {
+    unsigned line;
+    uint64_t start;
+    uint64_t child;
+} LineFrame;
+
+typedef struct {
+    uint64_t count;
+    uint64_t self_ns;
+    uint64_t total_ns;
+    int      active;
+} LineStats;
+
+static array_t line_frames;
+static array_t line_stats;   /* indexed by line */
+
+static void lprof_enter(unsigned line) {
+    LineFrame *frame;
+
+    frame        = array_next_elem(line_frames);
+    frame->line  = line;
+    frame->child = 0;
+    frame->start = now_ns();
+
+    ((LineStats*)array_item(line_stats, line))->active += 1;
+}
+
+static void lprof_leave(void) {
+    uint64_t   d;
+    LineFrame *frame;
+    LineStats *stats;
+
+    frame = array_last(line_frames);
+    stats = array_item(line_stats, frame->line);
+    d     = now_ns() - frame->start;
+
+    stats->count   += 1;
+    stats->self_ns += d - frame->child;
+    stats->active  -= 1;
+    if (stats->active == 0) {
+        stats->total_ns += d;
+    }
+
+    if (array_len(line_frames) > 1) {
+        (frame - 1)->child += d;
+    }
+
+    array_pop(line_frames);
+}
+
+static int lprof_cmp_self(const void *a, const void *b) {
+    const LineStats *sa;
+    const LineStats *sb;
+
+    sa = array_item(line_stats, *(unsigned*)a);
+    sb = array_item(line_stats, *(unsigned*)b);
+
+    if (sa->self_ns == sb->self_ns) { return *(unsigned*)a - *(unsigned*)b; }
+    return sa->self_ns < sb->self_ns ? 1 : -1;
+}
+
+static void lprof_report(void) {
+    uint64_t   total;
+    LineStats *stats;
+    array_t    hottest;
+    unsigned   l;
+    unsigned  *lit;
+    FILE      *src;
+    FILE      *f;
+    char      *text;
+    size_t     cap;
+    ssize_t    len;
+    int        i;
+
+    while (array_len(line_frames) > 0) {
+        lprof_leave();
+    }
+
+    total   = 0;
+    hottest = array_make(unsigned);
+    for (l = 1; l < array_len(line_stats); l += 1) {
+        stats  = array_item(line_stats, l);
+        total += stats->self_ns;
+        if (stats->count) { array_push(hottest, l); }
+    }
+    if (total == 0) { total = 1; }
+
+    qsort(array_data(hottest), array_len(hottest), sizeof(unsigned), lprof_cmp_self);
+
+    output_flush();
+    fprintf(stderr, "\nHottest lines (by self time):\n\n");
+    fprintf(stderr, "%6s %7s %12s %12s %12s\n", "line", "%time", "count", "self ms", "total ms");
+    i = 0;
+    array_traverse(hottest, lit) {
+        if (i++ == 10) { break; }
+        stats = array_item(line_stats, *lit);
+        fprintf(stderr, "%6u %7.2f %12llu %12.3f %12.3f\n",
+                *lit, 100.0 * stats->self_ns / total,
+                (unsigned long long)stats->count,
+                stats->self_ns / 1e6, stats->total_ns / 1e6);
+    }
+    array_free(hottest);
+
+    if ((src = fopen(source_path, "r")) == NULL
+    ||  (f   = fopen(line_profile_path, "w")) == NULL) {
+        fprintf(stderr, "Nickel: unable to write line profile to '%s'\n", line_profile_path);
+        if (src != NULL) { fclose(src); }
+        return;
+    }
+
+    fprintf(f, "%2s %6s %7s %12s %12s %12s  %s\n",
+            "", "line", "%time", "count", "self ms", "total ms", source_path);
+
+    text = NULL;
+    cap  = 0;
+    for (l = 1; (len = getline(&text, &cap, src)) >= 0; l += 1) {
+        if (len > 0 && text[len - 1] == '\n') { text[len - 1] = 0; }
+
+        stats = l < array_len(line_stats) ? array_item(line_stats, l) : NULL;
+
+        if (stats != NULL && stats->count) {
+            fprintf(f, "%2s %6u %7.2f %12llu %12.3f %12.3f  %s\n",
+                    100.0 * stats->self_ns / total >= LPROF_HOT_PERCENT ? ">>" : "",
+                    l, 100.0 * stats->self_ns / total,
+                    (unsigned long long)stats->count,
+                    stats->self_ns / 1e6, stats->total_ns / 1e6,
+                    text);
+        } else {
+            fprintf(f, "%2s %6u %7s %12s %12s %12s  %s\n", "", l, "", "", "", "", text);
+        }
+    }
+
+    free(text);
+    fclose(src);
+    fclose(f);
+
+    fprintf(stderr, "\nAnnotated source written to '%s'.\n", line_profile_path);
+}
+
+/* Called once parsing is done and we know how many lines there are. */
+static void lprof_init(unsigned n_lines) {
+    LineStats zero;
+    unsigned  l;
+
+    memset(&zero, 0, sizeof(zero));
+
+    line_frames = array_make(LineFrame);
+    line_stats  = array_make(LineStats);
+    for (l = 0; l <= n_lines; l += 1) {
+        array_push(line_stats, zero);
+    }
+
+    atexit(lprof_report);
+}
+
+
+
+/*** Trace export (--trace-json FILE). We buffer Chrome trace events in
+ *** memory and write them out at exit, so that they can be opened in
+ *** Perfetto or chrome://tracing. Parsing, each top-level form and output
+ *** flushes are always recorded; user-function calls only when they take
+ *** at least --trace-threshold microseconds. The recursion depth is
+ *** recorded as a counter. ***/
+
+/* How often, at most, the depth counter is recorded. */
+#define TRACE_COUNTER_INTERVAL_NS (50000)
+
+static const char *trace_path;
+static uint64_t    trace_threshold_ns = 100000;
+
+typedef struct {
+    const char *name;
+    char        ph;
+    unsigned    line;   /* names the event "line N" when name is NULL */
+    uint64_t    ts;
+    uint64_t    dur;
+    uint64_t    value;
+} TraceEvent;
+
+static array_t  trace_events;
+static array_t  trace_call_starts;
+static uint64_t trace_t0;
+static uint64_t trace_last_counter;
+
+static void trace_event(const char *name, char ph, unsigned line,
+                        uint64_t ts, uint64_t dur, uint64_t value) {
+    TraceEvent *ev;
+
+    ev        = array_next_elem(trace_events);
+    ev->name  = name;
+    ev->ph    = ph;
+    ev->line  = line;
+    ev->ts    = ts;
+    ev->dur   = dur;
+    ev->value = value;
+}
+
+static void trace_begin(const char *name, unsigned line) {
+    trace_event(name, 'B', line, now_ns(), 0, 0);
+}
+
+static void trace_end(const char *name, unsigned line) {
+    trace_event(name, 'E', line, now_ns(), 0, 0);
+}
+
+static void trace_depth(uint64_t now) {
+    if (now - trace_last_counter >= TRACE_COUNTER_INTERVAL_NS) {
+        trace_event("depth", 'C', 0, now, 0, shadow_depth);
+        trace_last_counter = now;
+    }
+}
+
+static void trace_call_enter(void) {
+    uint64_t now;
+
+    now = now_ns();
+    array_push(trace_call_starts, now);
+    trace_depth(now);
+}
+
+static void trace_call_leave(FnInfo *info) {
+    uint64_t now;
+    uint64_t start;
+
+    now   = now_ns();
+    start = *(uint64_t*)array_last(trace_call_starts);
+    array_pop(trace_call_starts);
+
+    if (now - start >= trace_threshold_ns) {
+        trace_event(info->name, 'X', 0, start, now - start, 0);
+    }
+    trace_depth(now);
+}
+
+static void trace_flush(uint64_t start, size_t bytes) {
+    uint64_t now;
+
+    now = now_ns();
+    trace_event("flush", 'X', 0, start, now - start, bytes);
+}
+
+static void trace_report(void) {
+    FILE       *f;
+    TraceEvent *ev;
+    int         first;
+
+    output_flush();
+    trace = 0;
+
+    if ((f = fopen(trace_path, "w")) == NULL) {
+        fprintf(stderr, "Nickel: unable to write trace to '%s'\n", trace_path);
+        return;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+
+    first = 1;
+    array_traverse(trace_events, ev) {
+        fprintf(f, "%s\n  {\"name\": ", first ? "" : ",");
+        if (ev->name != NULL) {
+            json_string(f, ev->name);
+        } else {
+            fprintf(f, "\"line %u\"", ev->line);
+        }
+        fprintf(f, ", \"ph\": \"%c\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f",
+                ev->ph, (ev->ts - trace_t0) / 1e3);
+
+        switch (ev->ph) {
+            case 'X':
+                fprintf(f, ", \"dur\": %.3f", ev->dur / 1e3);
+                if (ev->value) {
+                    fprintf(f, ", \"args\": {\"bytes\": %llu}", (unsigned long long)ev->value);
+                }
+                break;
+            case 'C':
+                fprintf(f, ", \"args\": {\"depth\": %llu}", (unsigned long long)ev->value);
+                break;
+            default:
+                if (ev->line) {
+                    fprintf(f, ", \"args\": {\"line\": %u}", ev->line);
+                }
+                break;
+        }
+        fprintf(f, "}");
+        first = 0;
+    }
+
+    fprintf(f, "\n]}\n");
+    fclose(f);
+}
+
+static void trace_init(void) {
+    trace_events      = array_make(TraceEvent);
+    trace_call_starts = array_make(uint64_t);
+    trace_t0          = now_ns();
+    trace             = 1;
+
+    atexit(trace_report);
+}
+
+
+
+/*** Runtime statistics. The counters in `stats` are always kept; they can
+ *** be read from Nickel with [stats] and are written by --stats-json FILE
+ *** at exit. ***/
+
+#define STATS_PROBE_BUCKETS (5)
+
+static const char *stats_path;
+
+/* How many entries of the function table are found in the first group of
+   slots probed for them, the second, ..., the fifth or later. Entries that
+   an incremental resize hasn't moved yet aren't counted. */
+static void stats_probe_lengths(uint64_t *counts) {
+    uint64_t i;
+    uint64_t len;
+
+    memset(counts, 0, STATS_PROBE_BUCKETS * sizeof(*counts));
+
+    for (i = 0; i < functions->_cap; i += 1) {
+        if (functions->_ctrl[i] < 0) { continue; }
+        len = FUNCTIONS(probe_len)(functions, i);
+        counts[len < STATS_PROBE_BUCKETS ? len : STATS_PROBE_BUCKETS - 1] += 1;
+    }
+}
+
+static uint64_t stats_peak_rss_kb(void) {
+    struct rusage usage;
 
-    node      = make_node(NAME_ATOM);
-    node.name = strdup(s);
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
 
-    return node;
+typedef struct {
+    const char *name;
+    uint64_t    value;
+} Stat;
+
+/* Fill `out` with the scalar statistics and return how many there are. */
+static int stats_collect(Stat *out) {
+    int n;
+
+    n = 0;
+#define STAT(_name, _value) { out[n].name = (_name); out[n].value = (_value); n += 1; }
+    STAT("evals",           stats.evals);
+    STAT("user-calls",      stats.user_calls);
+    STAT("builtin-calls",   stats.applications - stats.user_calls);
+    STAT("copies",          stats.copies);
+    STAT("copied-nodes",    stats.copied_nodes);
+    STAT("copied-bytes",    stats.copied_bytes);
+    STAT("moves",           stats.moves);
+    STAT("allocations",     alloc_count);
+    STAT("allocated-bytes", alloc_bytes);
+    STAT("peak-args-depth", stats.peak_args_depth);
+    STAT("peak-call-depth", stats.peak_call_depth);
+    STAT("functions",       hash_table_len(functions));
+    STAT("peak-rss-kb",     stats_peak_rss_kb());
+    STAT("source-bytes",    stats.source_bytes);
+    STAT("parse-ns",        stats.parse_ns);
+    STAT("eval-ns",         stats.eval_ns       ? stats.eval_ns
+                          : stats.eval_start_ns ? now_ns() - stats.eval_start_ns
+                          :                       0);
+#undef STAT
+
+    return n;
 }
 
-static Node copy_node(Node *node) {
-    Node  new;
-    Node *it;
-    Node  new_child;
+#define STATS_MAX (24)
 
-    switch (node->kind) {
-        case INT_ATOM:
-            new = make_int(node->integer);
-            break;
-        case STRING_ATOM:
-            new = make_string(node->string);
-            break;
-        case NAME_ATOM:
-            new = make_name(node->name);
-            break;
-        case LIST:
-            new = make_list();
-            array_traverse(node->children, it) {
-                new_child = copy_node(it);
-                array_push(new.children, new_child);
-            }
-            break;
+/* The value of [stats]: a list of [name value] pairs. */
+static NOINLINE Node stats_list(void) {
+    Stat     all[STATS_MAX];
+    uint64_t probes[STATS_PROBE_BUCKETS];
+    int      n;
+    int      i;
+    Node     result;
+    Node     pair;
+    Node     elem;
+    Node     count;
+
+    n      = stats_collect(all);
+    result = make_list();
+
+    for (i = 0; i < n; i += 1) {
+        pair = make_list();
+        elem = make_string(all[i].name); array_push(pair.children, elem);
+        elem = make_int(all[i].value);   array_push(pair.children, elem);
+        array_push(result.children, pair);
     }
 
-    return new;
+    stats_probe_lengths(probes);
+    pair = make_list();
+    elem = make_string("probe-lengths"); array_push(pair.children, elem);
+    elem = make_list();
+    for (i = 0; i < STATS_PROBE_BUCKETS; i += 1) {
+        count = make_int(probes[i]);
+        array_push(elem.children, count);
+    }
+    array_push(pair.children, elem);
+    array_push(result.children, pair);
+
+    return result;
 }
 
-static void free_node(Node *node) {
-    Node *it;
+static void stats_report(void) {
+    Stat      all[STATS_MAX];
+    uint64_t  probes[STATS_PROBE_BUCKETS];
+    int       n;
+    int       i;
+    FILE     *f;
 
-    switch (node->kind) {
-        case LIST:
-            array_traverse(node->children, it) {
-                free_node(it);
-            }
-            array_free(node->children);
-            break;
-        case INT_ATOM:
-            break;
-        case STRING_ATOM:
-            free((char*)node->string);
-            break;
-        case NAME_ATOM:
-            free((char*)node->name);
-            break;
-        default:
-            break;
+    if ((f = fopen(stats_path, "w")) == NULL) {
+        fprintf(stderr, "Nickel: unable to write stats to '%s'\n", stats_path);
+        return;
     }
-}
 
-static void _node_to_string(array_t *chars, Node *node) {
-    char  buff[32];
-    Node *it;
+    n = stats_collect(all);
 
-#define PUSHC(c) { char _c=(c); array_push(*chars, _c); }
-#define PUSHS(s) { const char *_s=(s); while (*_s) { PUSHC(*_s++); } }
+    fprintf(f, "{\n");
+    for (i = 0; i < n; i += 1) {
+        fprintf(f, "  \"%s\": %llu,\n", all[i].name, (unsigned long long)all[i].value);
+    }
 
-    switch (node->kind) {
-        case PROGRAM:
-            array_traverse(node->children, it) {
-                _node_to_string(chars, it);
-                PUSHC('\n');
-            }
-            break;
-        case LIST:
-            PUSHC('['); PUSHC(' ');
-            array_traverse(node->children, it) {
-                _node_to_string(chars, it);
-                PUSHC(' ');
-            }
-            PUSHC(']');
-            break;
-        case INT_ATOM:
-            snprintf(buff, sizeof(buff), "%lld", node->integer);
-            PUSHS(buff);
-            break;
-        case STRING_ATOM:
-            PUSHS(node->string);
-            break;
-        case NAME_ATOM:
-            PUSHS("<name ");
-            PUSHS(node->name);
-            PUSHC('>');
-            break;
-        default:
-            break;
+    stats_probe_lengths(probes);
+    fprintf(f, "  \"probe-lengths\": [");
+    for (i = 0; i < STATS_PROBE_BUCKETS; i += 1) {
+        fprintf(f, "%s%llu", i ? ", " : "", (unsigned long long)probes[i]);
     }
-}
+    fprintf(f, "]\n}\n");
 
-static char *node_to_string(Node *node) {
-    array_t chars;
+    fclose(f);
+}
 
-    chars = array_make(char);
-    _node_to_string(&chars, node);
 
-    array_zero_term(chars);
 
-    return array_data(chars);
-}
+/*** The resource budget (--max-steps, --max-heap, --timeout). Every
+ *** evaluation decrements `budget_countdown`; only when it reaches zero do
+ *** we take the slow path, which checks the step and time limits and
+ *** refills the countdown. The heap limit is checked in the allocator
+ *** against the bytes currently live. Exceeding any limit is an ERROR. ***/
 
-static void print_node(Node *node) {
-    char *str;
+#define BUDGET_CHECK_INTERVAL (4096)
 
-    str = node_to_string(node);
-    fwrite(str, 1, strlen(str), stdout);
-    fwrite("\n", 1, 1, stdout);
-    free(str);
-}
+static uint64_t max_steps;
+static uint64_t max_time_ns;
+static uint64_t budget_deadline;
+static int64_t  budget_countdown = BUDGET_CHECK_INTERVAL;
+static uint64_t budget_heap_live;
 
+static void budget_heap_alloc(void *p) {
+    uint64_t limit;
 
-/*** Our top-level data: ***/
+    budget_heap_live += malloc_usable_size(p);
+    if (budget_heap_live > max_heap) {
+        /* Disarm the limit first: ERROR exits, and the reports run at exit
+           allocate too. Hitting the limit again there would exit() from
+           within exit(). */
+        limit    = max_heap;
+        max_heap = 0;
+        ERROR("heap limit of %llu bytes exceeded (%llu bytes live)\n",
+              (unsigned long long)limit, (unsigned long long)budget_heap_live);
+    }
+}
 
-/* The root node. */
-static Node program;
+static void budget_heap_free(void *p) {
+    budget_heap_live -= malloc_usable_size(p);
+}
 
-/* Our place in the file we are currently parsing. */
-static const char *cursor;
+static void budget_refill(void) {
+    budget_countdown = BUDGET_CHECK_INTERVAL;
+    /* Stop right after the last step we are allowed. */
+    if (max_steps && max_steps + 1 - stats.evals < BUDGET_CHECK_INTERVAL) {
+        budget_countdown = max_steps + 1 - stats.evals;
+    }
+}
 
-/* Current line number. */
-static unsigned line = 1;
+static void budget_check(void) {
+    if (max_steps && stats.evals > max_steps) {
+        ERROR("step limit of %llu evaluations exceeded\n",
+              (unsigned long long)max_steps);
+    }
+    if (budget_deadline && now_ns() >= budget_deadline) {
+        ERROR("time limit of %.3fs exceeded\n", max_time_ns / 1e9);
+    }
+    budget_refill();
+}
 
-/* Set up some things for a hash_table, which we'll use as a symbol table. */
-static uint64_t str_hash(const char *s) {
-    uint64_t hash = 5381;
-    int c;
+/* The value of [budget]: how much of each limit is left, or -1 for the ones
+   that aren't set. */
+static NOINLINE Node budget_list(void) {
+    Node      result;
+    Node      pair;
+    Node      elem;
+    uint64_t  now;
+    long long left[3];
+    int       i;
+
+    static const char *names[] = { "steps", "heap", "time-ms" };
+
+    now     = now_ns();
+    left[0] = max_steps       ? (long long)(max_steps - stats.evals)                : -1;
+    left[1] = max_heap        ? (long long)(max_heap - budget_heap_live)            : -1;
+    left[2] = budget_deadline ? (long long)(budget_deadline - now) / 1000000        : -1;
+
+    result = make_list();
+    for (i = 0; i < 3; i += 1) {
+        if (left[i] < -1) { left[i] = 0; }
+        pair = make_list();
+        elem = make_string(names[i]); array_push(pair.children, elem);
+        elem = make_int(left[i]);     array_push(pair.children, elem);
+        array_push(result.children, pair);
+    }
 
-    while ((c = *s++))
-        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+    return result;
+}
 
-    return hash;
+static void budget_init(void) {
+    if (max_time_ns) { budget_deadline = now_ns() + max_time_ns; }
+    budget_refill();
 }
-static int str_equ(const char *a, const char *b) { return strcmp(a, b) == 0; }
-typedef const char *fn_name_t;
-use_hash_table(fn_name_t, array_t);
 
-/* Symbol table for user-defined functions */
-static hash_table(fn_name_t, array_t) functions;
+/* Parse a byte count with an optional K, M or G suffix. */
+static uint64_t parse_size(const char *s) {
+    char     *end;
+    uint64_t  n;
 
-/* An argument stack. */
-static array_t args;
+    n = strtoull(s, &end, 10);
+    switch (toupper(*end)) {
+        case 'K': n <<= 10; end += 1; break;
+        case 'M': n <<= 20; end += 1; break;
+        case 'G': n <<= 30; end += 1; break;
+    }
+    if (end == s || *end != 0) {
+        ERROR("expected a size such as 4096, 64K or 1G, got '%s'\n", s);
+    }
+
+    return n;
+}
 
 
 
 /*** Parsing code. ***/
 
-/* Macro to clean up whitespace and consume comments. */
-#define CLEAN()                                              \
-do {                                                         \
-    while (*cursor && isspace(*cursor)) {                    \
-        if (*cursor == '\n') { line += 1; }                  \
-        cursor += 1;                                         \
-    }                                                        \
-    while (*cursor == ';') {                                 \
-        while (*cursor && *cursor != '\n')  { cursor += 1; } \
-        while (*cursor && isspace(*cursor)) {                \
-            if (*cursor == '\n') { line += 1; }              \
-            cursor += 1;                                     \
-        }                                                    \
-    }                                                        \
+/* Macro to clean up whitespace and consume comments. The check in front
+   saves calling into the kernel when there is nothing to skip. */
+#define SKIP_SPACE()                                               \
+do {                                                               \
+    if (simd_is_space(*cursor)) {                                  \
+        cursor = simd.skip_space(cursor, &line, &line_start);      \
+    }                                                              \
 } while (0)
 
+#define CLEAN()                                  \
+do {                                             \
+    SKIP_SPACE();                                \
+    while (*cursor == ';') {                     \
+        cursor = simd.find_newline(cursor);      \
+        SKIP_SPACE();                            \
+    }                                            \
+} while (0)
+
+/* Record the current position in `locs`. */
+static unsigned make_loc(void) {
+    SrcLoc loc;
+
+    loc.line = line;
+    loc.col  = cursor - line_start + 1;
+    array_push(locs, loc);
+
+    return array_len(locs) - 1;
+}
+
 /* Load a file directly into memory. */
-static const char * mmap_file(const char *path) {
+static const char * mmap_file(const char *path, size_t *size) {
     int          fd;
     struct stat  fs;
     void        *p;
@@ -286,6 +2420,10 @@ static const char * mmap_file(const char *path) {
     p = mmap(NULL, fs.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
     if (p == MAP_FAILED) { p = NULL; }
 
+    close(fd);
+
+    *size = fs.st_size;
+
     return p;
 }
 
@@ -296,12 +2434,16 @@ static Node parse_node(void) {
     long long   j;
     char       *p;
     char       *new_cursor;
+    const char *end;
     Node        child;
+    unsigned    loc;
 
     node.kind = INVALID;
 
     CLEAN();
 
+    loc = make_loc();
+
     if (*cursor == 0) {
         /* ignore end of file */
     } else if (isdigit(*cursor) || (*cursor == '-' && isdigit(*(cursor + 1)))) {
@@ -320,7 +2462,7 @@ static Node parse_node(void) {
         node = make_node(LIST);
 
         while (*cursor != ']' && (child = parse_node()).kind != INVALID) {
-            array_push(node.children, child);
+            NODES(push)(&node.children, &child);
             CLEAN();
         }
 
@@ -336,12 +2478,14 @@ static Node parse_node(void) {
 
         cursor += 1;
 
-        i = 0;
-        while (cursor[i] && (cursor[i] != '"' || (i > 0 && cursor[i-1] == '\\'))) {
-            i += 1;
+        /* Find the closing quote, skipping escaped ones. */
+        end = cursor;
+        while (*(end = simd.find_quote(end)) == '"' && end > cursor && end[-1] == '\\') {
+            end += 1;
         }
+        i = end - cursor;
 
-        node.string = p = malloc(i + 1);
+        node.string = p = nk_malloc(i + 1, HEAP_STRING);
         for (j = 0; j < i; j += 1) {
             if (cursor[j] != '\\') {
                 if (j > 0 && cursor[j - 1] == '\\') {
@@ -376,6 +2520,8 @@ static Node parse_node(void) {
         }
         *p = 0;
 
+        line += simd.count_newlines(cursor, i, &line_start);
+
         cursor += i;
 
         if (*cursor != '"') {
@@ -386,18 +2532,17 @@ static Node parse_node(void) {
     } else if (*cursor != ']') {
         node = make_node(NAME_ATOM);
 
-        i = 0;
-        while (cursor[i] && !isspace(cursor[i]) && cursor[i] != ']') {
-            i += 1;
-        }
+        i = simd.find_name_end(cursor) - cursor;
 
-        node.name = strndup(cursor, i);
+        node.name = nk_strndup(cursor, i, HEAP_NAME);
 
         cursor += i;
     } else {
         ERROR("line %u: unexpected character '%c'\n", line, *cursor);
     }
 
+    node.loc = loc;
+
     return node;
 }
 
@@ -412,7 +2557,7 @@ static Node parse_node(void) {
 
 /* Convenience macro to get a child node from a list. */
 #define CHILD(_children, _idx) \
-    ((Node*)array_item((_children), (_idx)))
+    (NODES(item)(&(_children), (_idx)))
 
 /* Type check the application of a function.
  * `arity` indicates how many arguments are expected and the following
@@ -448,6 +2593,186 @@ static void check(array_t *evaluated_nodes, int arity, ...) {
     va_end(args);
 }
 
+
+
+/*** Maps. See the definition of Map above. ***/
+
+#define MAP_TABLE(op) hash_table_call(MapKey, Node, op)
+
+/* The finalizer of splitmix64: every bit of i affects every bit of the
+   hash, so keys like 0, 1, 2, ... or multiples of 1024 spread out. */
+static uint64_t int_hash(long long i) {
+    uint64_t x;
+
+    x  = (uint64_t)i;
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+
+    return x;
+}
+
+static Node make_map(void) {
+    Node node;
+
+    node               = make_node(MAP);
+    node.map           = nk_malloc(sizeof(Map), HEAP_MAP);
+    node.map->refs     = 1;
+    node.map->printing = 0;
+    node.map->table    = hash_table_make_incremental(MapKey, Node, map_key_hash, map_key_equ);
+
+    return node;
+}
+
+static void map_release(Map *map) {
+    MapKey  key;
+    Node   *val;
+
+    map->refs -= 1;
+    if (map->refs > 0) { return; }
+
+    hash_table_traverse(map->table, key, val) {
+        if (key.kind == STRING_ATOM) { nk_free((char*)key.string); }
+        free_node(val);
+    }
+    hash_table_free(map->table);
+    nk_free(map);
+}
+
+/* The key for `node`. A string key borrows the node's string. */
+static MapKey map_key(Node *node) {
+    MapKey key;
+
+    key.kind = node->kind;
+
+    if (node->kind == INT_ATOM) {
+        key.integer = node->integer;
+        key.hash    = int_hash(node->integer);
+    } else if (node->kind == STRING_ATOM) {
+        key.string = node->string;
+        key.hash   = str_hash(node->string);
+    } else {
+        ERROR("map keys must be integers or strings\n");
+    }
+
+    return key;
+}
+
+static int map_key_cmp(const void *a, const void *b) {
+    const MapKey *ka;
+    const MapKey *kb;
+
+    ka = a;
+    kb = b;
+
+    if (ka->kind != kb->kind) { return ka->kind == INT_ATOM ? -1 : 1; }
+    if (ka->kind == STRING_ATOM) { return strcmp(ka->string, kb->string); }
+
+    return (ka->integer > kb->integer) - (ka->integer < kb->integer);
+}
+
+/* The keys of a map in a fixed order, integers first, so that printing a
+   map doesn't depend on how its keys hash. */
+static array_t map_sorted_keys(Map *map) {
+    array_t  keys;
+    MapKey   key;
+    Node    *val;
+
+    keys = array_make(MapKey);
+    hash_table_traverse(map->table, key, val) {
+        (void)val;
+        array_push(keys, key);
+    }
+    if (array_len(keys) > 1) {
+        qsort(array_data(keys), array_len(keys), sizeof(MapKey), map_key_cmp);
+    }
+
+    return keys;
+}
+
+/* Apply the map builtin `name`, if there is one by that name, leaving its
+   value in `result`. */
+static NOINLINE int map_builtin(const char *name, array_t *evaluated_nodes, Node *result) {
+    Map     *map;
+    MapKey   key;
+    MapKey  *stored;
+    Node    *val;
+    Node     elem;
+    array_t  keys;
+
+    map = array_len(*evaluated_nodes) > 1 && CHILD(*evaluated_nodes, 1)->kind == MAP
+            ? CHILD(*evaluated_nodes, 1)->map
+            : NULL;
+
+    if (strcmp(name, "map-new") == 0) {
+        check(evaluated_nodes, 0);
+        *result = make_map();
+    } else if (strcmp(name, "map-get") == 0) {
+        if (array_len(*evaluated_nodes) == 4) {
+            check(evaluated_nodes, 3, MAP, -1, -1);
+        } else {
+            check(evaluated_nodes, 2, MAP, -1);
+        }
+        val = MAP_TABLE(get_val)(map->table, map_key(CHILD(*evaluated_nodes, 2)));
+        if (val == NULL) {
+            if (array_len(*evaluated_nodes) < 4) {
+                ERROR("map-get: key not found (pass a default as the third argument)\n");
+            }
+            *result = move_node(CHILD(*evaluated_nodes, 3));
+        } else {
+            *result = copy_node(val);
+        }
+    } else if (strcmp(name, "map-put!") == 0) {
+        check(evaluated_nodes, 3, MAP, -1, -1);
+        key  = map_key(CHILD(*evaluated_nodes, 2));
+        elem = move_node(CHILD(*evaluated_nodes, 3));
+        if ((val = MAP_TABLE(get_val)(map->table, key)) != NULL) {
+            free_node(val);
+            *val = elem;
+        } else {
+            if (key.kind == STRING_ATOM) { key.string = nk_strdup(key.string, HEAP_STRING); }
+            MAP_TABLE(insert)(map->table, key, elem);
+        }
+        *result = move_node(CHILD(*evaluated_nodes, 1));
+    } else if (strcmp(name, "map-has") == 0) {
+        check(evaluated_nodes, 2, MAP, -1);
+        *result = make_int(MAP_TABLE(get_val)(map->table, map_key(CHILD(*evaluated_nodes, 2))) != NULL);
+    } else if (strcmp(name, "map-del!") == 0) {
+        check(evaluated_nodes, 2, MAP, -1);
+        key    = map_key(CHILD(*evaluated_nodes, 2));
+        stored = MAP_TABLE(get_key)(map->table, key);
+        if (stored != NULL) {
+            key  = *stored;
+            elem = *MAP_TABLE(get_val)(map->table, key);
+            MAP_TABLE(delete)(map->table, key);
+            free_node(&elem);
+            if (key.kind == STRING_ATOM) { nk_free((char*)key.string); }
+        }
+        *result = make_int(stored != NULL);
+    } else if (strcmp(name, "map-keys") == 0) {
+        check(evaluated_nodes, 1, MAP);
+        keys    = map_sorted_keys(map);
+        *result = make_list();
+        array_traverse(keys, stored) {
+            elem = stored->kind == INT_ATOM ? make_int(stored->integer)
+                                            : make_string(stored->string);
+            array_push(result->children, elem);
+        }
+        array_free(keys);
+    } else if (strcmp(name, "map-len") == 0) {
+        check(evaluated_nodes, 1, MAP);
+        *result = make_int(hash_table_len(map->table));
+    } else {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+
 static Node interpret(Node *node);
 
 /* Interpret the `if` special form. It is important that only one of the
@@ -485,13 +2810,13 @@ static Node interpret_if(Node *node) {
    function is pretty short and simply copies the function (as a tree) into
    our symbol table, keyed on the name. Replace the function if it is already
    in the table. */
-static Node interpret_define(Node *node) {
+static NOINLINE Node interpret_define(Node *node) {
     Node       name;
     fn_name_t *lookup;
     fn_name_t  key;
-    array_t    existing;
+    Function   existing;
     Node      *it;
-    array_t    expressions;
+    Function   function;
     Node       expr;
 
     if (array_len(node->children) < 3) {
@@ -500,47 +2825,125 @@ static Node interpret_define(Node *node) {
 
     name = copy_node(CHILD(node->children, 1));
 
-    lookup = hash_table_get_key(functions, name.name);
+    NK_PROBE1(define, name.name);
+    if (name.kind == NAME_ATOM) {
+        flight_record(FLIGHT_DEFINE, name.name, array_len(node->children) - 2);
+    }
+
+    lookup = FUNCTIONS(get_key)(functions, name.name);
     if (lookup != NULL) {
         key      = *lookup;
-        existing = *hash_table_get_val(functions, key);
-        hash_table_delete(functions, key);
+        existing = *FUNCTIONS(get_val)(functions, key);
+        FUNCTIONS(delete)(functions, key);
     }
 
-    expressions = array_make(Node);
+    function.exprs = array_make_tagged(Node, HEAP_LIST);
+    function.info  = lookup != NULL ? existing.info : fn_info_make(name.name);
 
     array_traverse_from(node->children, it, 2) {
         expr = copy_node(it);
-        array_push(expressions, expr);
+        array_push(function.exprs, expr);
     }
 
-    hash_table_insert(functions, strdup(name.name), expressions);
+    FUNCTIONS(insert)(functions, nk_strdup(name.name, HEAP_SYMBOL), function);
 
     if (lookup != NULL) {
-        array_traverse(existing, it) {
+        array_traverse(existing.exprs, it) {
             free_node(it);
         }
-        array_free(existing);
-        free((char*)key);
+        array_free(existing.exprs);
+        nk_free((char*)key);
     }
 
     return name;
 }
 
+static int u64_cmp(const void *a, const void *b) {
+    uint64_t ua;
+    uint64_t ub;
+
+    ua = *(uint64_t*)a;
+    ub = *(uint64_t*)b;
+
+    return ua < ub ? -1 : ua > ub;
+}
+
+/* Interpret the `bench` special form: [bench expr iterations]. The
+   expression is evaluated `iterations` times (after a few untimed warmup
+   runs) straight from the tree, without copying it. The result is the list
+   [min median p99 allocations-per-iteration], with times in nanoseconds. */
+static NOINLINE Node interpret_bench(Node *node) {
+    Node       *expr;
+    Node        n_node;
+    long long   n;
+    long long   i;
+    Node        val;
+    array_t     times;
+    uint64_t    start;
+    uint64_t    allocs;
+    uint64_t   *sorted;
+    Node        result;
+    Node        elem;
+
+    if (array_len(node->children) != 3) {
+        ERROR("bench expects an expression and a number of iterations\n");
+    }
+
+    expr   = CHILD(node->children, 1);
+    n_node = interpret(CHILD(node->children, 2));
+
+    if (n_node.kind != INT_ATOM || n_node.integer < 1) {
+        ERROR("bench iterations must be a positive integer\n");
+    }
+
+    n = n_node.integer;
+
+    for (i = 0; i < n / 10 + 1; i += 1) {
+        val = interpret(expr);
+        free_node(&val);
+    }
+
+    times = array_make_with_cap(uint64_t, n);
+    array_grow_if_needed(times);
+
+    allocs = alloc_count;
+    for (i = 0; i < n; i += 1) {
+        start = now_ns();
+        val   = interpret(expr);
+        free_node(&val);
+        start = now_ns() - start;
+        array_push(times, start);
+    }
+    allocs = alloc_count - allocs;
+
+    sorted = array_data(times);
+    qsort(sorted, n, sizeof(uint64_t), u64_cmp);
+
+    result = make_list();
+    elem   = make_int(sorted[0]);                  array_push(result.children, elem);
+    elem   = make_int(sorted[n / 2]);              array_push(result.children, elem);
+    elem   = make_int(sorted[(n * 99 - 1) / 100]); array_push(result.children, elem);
+    elem   = make_int(allocs / n);                 array_push(result.children, elem);
+
+    array_free(times);
+
+    return result;
+}
+
 /* Implementation of the fmt functions that uses printf's formatting. */
-static const char *do_fmt(array_t nodes) {
+static NOINLINE const char *do_fmt(array_t nodes) {
     array_t     chars;
     const char *fmt;
-    int         node_idx;
+    uint64_t    node_idx;
     char        last;
     char        c;
     char        buff[64];
     char       *buffp;
-    int         var_width;
+    uint64_t    var_width;
     char       *node_str;
     char       *str;
 
-    chars = array_make(char);
+    chars = array_make_tagged(char, HEAP_CHARS);
     array_zero_term(chars);
 
     fmt = CHILD(nodes, 1)->string;
@@ -552,7 +2955,7 @@ static const char *do_fmt(array_t nodes) {
         if (c == '{') {
             if (last == '\\') {
                 array_pop(chars);
-                array_push(chars, c);
+                CHARS(push)(&chars, &c);
             } else {
                 fmt += 1;
 
@@ -586,7 +2989,7 @@ static const char *do_fmt(array_t nodes) {
                         asprintf(&str, buff, node_str);
                         node_idx += 1;
                     }
-                    free(node_str);
+                    nk_free(node_str);
                 } else {
                     if (var_width) {
                         asprintf(&str, buff, CHILD(nodes, node_idx)->integer, CHILD(nodes, node_idx + 1)->_v);
@@ -596,16 +2999,18 @@ static const char *do_fmt(array_t nodes) {
                         node_idx += 1;
                     }
                 }
-                array_push_n(chars, str, strlen(str));
+                CHARS(push_n)(&chars, str, strlen(str));
                 free(str);
             }
         } else {
-            array_push(chars, c);
+            CHARS(push)(&chars, &c);
         }
         last = c;
         fmt += 1;
     }
 
+    array_zero_term(chars);
+
     return array_data(chars);
 }
 
@@ -618,10 +3023,15 @@ static Node apply(Node *node) {
     Node       *it;
     Node       *it2;
     Node        elem;
-    array_t    *lookup;
+    Function   *lookup;
+    FnInfo     *info;
+    const char *saved_site;
+    unsigned    at_line;
     array_t     fn_exprs;
     array_t     apply_args;
 
+    at_line = node->loc ? NODE_LINE(node) : (unsigned)current_line;
+
     if (array_len(node->children) < 1) {
         ERROR("no function to apply in empty list\n"
               "  did you mean to create an empty list? [list]\n");
@@ -639,19 +3049,35 @@ static Node apply(Node *node) {
     if (strcmp(name, "if") == 0) {
         free_node(&first);
         return interpret_if(node);
+    } else if (strcmp(name, "bench") == 0) {
+        free_node(&first);
+        return interpret_bench(node);
     } else if (strcmp(name, "define") == 0) {
         free_node(&first);
-        return interpret_define(node);
+        saved_site   = current_site;
+        current_site = "define";
+        result       = interpret_define(node);
+        current_site = saved_site;
+        return result;
     }
 
     /* evaluate elements and apply function */
-    evaluated_nodes = array_make(Node);
-    array_push(evaluated_nodes, first);
+    evaluated_nodes = array_make_tagged(Node, HEAP_LIST);
+    NODES(push)(&evaluated_nodes, &first);
     array_traverse_from(node->children, it, 1) {
         result = interpret(it);
-        array_push(evaluated_nodes, result);
+        NODES(push)(&evaluated_nodes, &result);
     }
 
+    saved_site   = current_site;
+    current_site = name;
+    current_line = at_line;
+
+    NK_PROBE2(apply, name, at_line);
+
+    stats.applications += 1;
+    flight_record(FLIGHT_BUILTIN, name, array_len(evaluated_nodes) - 1);
+
     if (strcmp(name, "+") == 0) {
         check(&evaluated_nodes, 2, INT_ATOM, INT_ATOM);
         result = make_int(  CHILD(evaluated_nodes, 1)->integer
@@ -699,30 +3125,30 @@ static Node apply(Node *node) {
     } else if (strcmp(name, "list") == 0) {
         result = make_list();
         array_traverse_from(evaluated_nodes, it, 1) {
-            elem = copy_node(it);
-            array_push(result.children, elem);
+            elem = move_node(it);
+            NODES(push)(&result.children, &elem);
         }
     } else if (strcmp(name, "len") == 0) {
         check(&evaluated_nodes, 1, LIST);
         result = make_int(array_len(CHILD(evaluated_nodes, 1)->children));
     } else if (strcmp(name, "append") == 0) {
         check(&evaluated_nodes, 2, LIST, LIST);
-        result = make_list();
-        array_traverse(CHILD(evaluated_nodes, 1)->children, it) {
-            elem = copy_node(it);
-            array_push(result.children, elem);
-        }
-        array_traverse(CHILD(evaluated_nodes, 2)->children, it) {
-            elem = copy_node(it);
-            array_push(result.children, elem);
-        }
+        /* Lists are never shared, so the first list is ours alone: extend
+           it in place, which grows its buffer by doubling, and move the
+           elements of the second one onto its end. Building a list with
+           [append acc [list x]] is then linear rather than quadratic. */
+        result = move_node(CHILD(evaluated_nodes, 1));
+        it     = CHILD(evaluated_nodes, 2);
+        NODES(push_n)(&result.children, array_data(it->children), array_len(it->children));
+        stats.moves += array_len(it->children);
+        array_clear(it->children);
     } else if (strcmp(name, "car") == 0) {
         check(&evaluated_nodes, 1, LIST);
         it = CHILD(evaluated_nodes, 1);
         if (array_len(it->children) < 1) {
             ERROR("car expects a non-empty list\n");
         }
-        result = copy_node(CHILD(it->children, 0));
+        result = move_node(CHILD(it->children, 0));
     } else if (strcmp(name, "cdr") == 0) {
         check(&evaluated_nodes, 1, LIST);
 
@@ -730,15 +3156,32 @@ static Node apply(Node *node) {
         it     = CHILD(evaluated_nodes, 1);
 
         array_traverse_from(it->children, it2, 1) {
-            elem = copy_node(it2);
-            array_push(result.children, elem);
+            elem = move_node(it2);
+            NODES(push)(&result.children, &elem);
         }
+    } else if (strcmp(name, "heap-report") == 0) {
+        check(&evaluated_nodes, 0);
+        if (heap_census) {
+            heap_report("on request");
+        } else {
+            fprintf(stderr, "Nickel: [heap-report] requires --heap-census\n");
+        }
+        result = make_int(0);
     } else if (strcmp(name, "rand") == 0) {
         result = make_int(rand());
+    } else if (strcmp(name, "stats") == 0) {
+        check(&evaluated_nodes, 0);
+        result = stats_list();
+    } else if (strcmp(name, "budget") == 0) {
+        check(&evaluated_nodes, 0);
+        result = budget_list();
+    } else if (strcmp(name, "clock-ns") == 0) {
+        check(&evaluated_nodes, 0);
+        result = make_int(now_ns());
     } else if (strcmp(name, "print") == 0) {
         check(&evaluated_nodes, 1, -1);
         print_node(CHILD(evaluated_nodes, 1));
-        result = copy_node(CHILD(evaluated_nodes, 1));
+        result = move_node(CHILD(evaluated_nodes, 1));
     } else if (strcmp(name, "fmt") == 0) {
         if (array_len(evaluated_nodes) < 2) {
             ERROR("fmt expects at least one argument\n");
@@ -755,28 +3198,50 @@ static Node apply(Node *node) {
             ERROR("first argument to pfmt must be a string\n");
         }
         result = make_string_no_dup(do_fmt(evaluated_nodes));
-        fwrite(result.string, 1, strlen(result.string), stdout);
-    } else if ((lookup = hash_table_get_val(functions, name)) != NULL) {
+        output_write(result.string, strlen(result.string));
+    } else if (strncmp(name, "map-", 4) == 0 && map_builtin(name, &evaluated_nodes, &result)) {
+        /* map_builtin() did the work. */
+    } else if ((lookup = FUNCTIONS(get_val)(functions, name)) != NULL) {
         /* The function to apply isn't built in, but is found in our symbol
            table. */
 
         /* Push the arguments onto the stack so that argument references
-           within the function are resolved properly. */
-        apply_args = array_make(Node);
+           within the function are resolved properly. They're ours, so they
+           are moved rather than copied. */
+        apply_args = array_make_tagged(Node, HEAP_LIST);
         array_traverse(evaluated_nodes, it) {
-            elem = copy_node(it);
-            array_push(apply_args, elem);
+            elem = move_node(it);
+            NODES(push)(&apply_args, &elem);
         }
         array_push(args, apply_args);
+        if (array_len(args) > stats.peak_args_depth) {
+            stats.peak_args_depth = array_len(args);
+        }
 
         /* Evaluated each expression in the function. */
         /* We have to deep copy the function since it can effectively
            delete its nodes if it redefines itself. */
-        fn_exprs = array_make(Node);
-        array_traverse(*lookup, it) {
+        fn_exprs = array_make_tagged(Node, HEAP_LIST);
+        array_traverse(lookup->exprs, it) {
             elem = copy_node(it);
-            array_push(fn_exprs, elem);
+            NODES(push)(&fn_exprs, &elem);
+        }
+
+        /* `lookup` may not survive evaluation of the body, but `info` will. */
+        info = lookup->info;
+
+        current_site = info->name;
+
+        shadow_push(info);
+        flight_mark_call();
+        stats.user_calls += 1;
+        if ((uint64_t)shadow_depth > stats.peak_call_depth) {
+            stats.peak_call_depth = shadow_depth;
         }
+        NK_PROBE2(function__entry, info->name, shadow_depth);
+        if (profile) { prof_enter(info); }
+        if (trace)   { trace_call_enter(); }
+        if (sample_hz) { sample_maybe_drain(); }
 
         result.kind = INVALID;
         array_traverse(fn_exprs, it) {
@@ -788,6 +3253,12 @@ static Node apply(Node *node) {
         }
         array_free(fn_exprs);
 
+        if (trace)   { trace_call_leave(info); }
+        if (profile) { prof_leave(); }
+        NK_PROBE2(function__return, info->name, shadow_depth);
+        shadow_pop();
+        flight_record(FLIGHT_RETURN, info->name, 0);
+
         /* Remove the arguments from the stack. */
         array_pop(args);
         array_traverse(apply_args, it) {
@@ -798,6 +3269,8 @@ static Node apply(Node *node) {
         ERROR("unknown function '%s'\n", name);
     }
 
+    current_site = saved_site;
+
     array_traverse(evaluated_nodes, it) {
         free_node(it);
     }
@@ -817,19 +3290,32 @@ static Node interpret(Node *node) {
 
     val.kind = INVALID;
 
+    stats.evals += 1;
+    if (--budget_countdown == 0) { budget_check(); }
+
     switch (node->kind) {
         case INVALID:
             ERROR("bad node!!!\n");
             break;
         case PROGRAM:
             array_traverse(node->children, it) {
+                if (trace) { trace_begin(NULL, it->loc ? NODE_LINE(it) : 0); }
                 val = interpret(it);
                 free_node(&val);
+                if (trace) { trace_end(NULL, it->loc ? NODE_LINE(it) : 0); }
             }
             break;
         case LIST:
+            if (node->loc) { current_line = NODE_LINE(node); }
+
             /* Lists are always a function application. */
-            val = apply(node);
+            if (line_profile) {
+                lprof_enter(current_line);
+                val = apply(node);
+                lprof_leave();
+            } else {
+                val = apply(node);
+            }
             break;
         case INT_ATOM:
         case STRING_ATOM:
@@ -849,7 +3335,7 @@ static Node interpret(Node *node) {
                     ERROR("unable to parse argument index from '%s'\n", node->name);
                 }
 
-                if (array_len(*apply_args) <= idx) {
+                if (idx < 0 || array_len(*apply_args) <= (uint64_t)idx) {
                     ERROR("argument reference invalid (%lld)\n", idx);
                 }
 
@@ -865,31 +3351,162 @@ static Node interpret(Node *node) {
     return val;
 }
 
+#define USAGE                                                                        \
+    "USAGE: %s [OPTIONS] FILE\n"                                                     \
+    "options:\n"                                                                     \
+    "  --seed N                 seed [rand] with N instead of the time\n"            \
+    "  --profile                report calls, time and bytes per user function\n"    \
+    "  --profile-json FILE      where --profile writes its JSON report\n"            \
+    "                           (default: nickel-profile.json)\n"                    \
+    "  --perf-counters          add hardware counters (IPC, cache and branch\n"      \
+    "                           misses) to --profile\n"                              \
+    "  --sample HZ              sample the Nickel call stack HZ times per CPU\n"     \
+    "                           second and write folded stacks\n"                    \
+    "  --sample-out FILE        where --sample writes its folded stacks\n"           \
+    "                           (default: nickel-samples.folded)\n"                  \
+    "  --alloc-stats            report allocations by site and size at exit\n"       \
+    "  --heap-census            report live objects by kind and site at exit\n"      \
+    "  --line-profile           count and time the applications on each line\n"      \
+    "                           and write an annotated copy of the source\n"         \
+    "  --line-profile-out FILE  where --line-profile writes the annotated source\n"  \
+    "                           (default: nickel-lines.txt)\n"                       \
+    "  --trace-json FILE        write a Chrome trace of parsing, top-level forms,\n" \
+    "                           slow function calls and output flushes\n"            \
+    "  --trace-threshold US     only trace calls taking at least US microseconds\n"  \
+    "                           (default: 100)\n"                                    \
+    "  --stats-json FILE        write runtime statistics as JSON at exit\n"          \
+    "  --max-steps N            stop with an error after N evaluations\n"            \
+    "  --max-heap SIZE          stop with an error when more than SIZE bytes\n"      \
+    "                           are live (suffixes K, M and G are allowed)\n"        \
+    "  --timeout SECONDS        stop with an error after SECONDS of wall time\n"
+
 int main(int argc, char **argv) {
-    Node node;
+    Node        node;
+    const char *path;
+    int         i;
+    const char *source;
+    size_t      source_size;
+    SrcLoc      loc;
+    unsigned    seed;
+    int         seed_set;
+
+    simd_init();
+
+    path     = NULL;
+    seed     = 0;
+    seed_set = 0;
+
+    for (i = 1; i < argc; i += 1) {
+        if (strcmp(argv[i], "--profile") == 0) {
+            profile = 1;
+        } else if (strcmp(argv[i], "--profile-json") == 0 && i + 1 < argc) {
+            profile           = 1;
+            profile_json_path = argv[++i];
+        } else if (strcmp(argv[i], "--perf-counters") == 0) {
+            profile       = 1;
+            perf_counters = 1;
+        } else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) {
+            sample_hz = atoi(argv[++i]);
+            if (sample_hz <= 0) {
+                ERROR("--sample expects a positive rate in Hz\n");
+            }
+        } else if (strcmp(argv[i], "--line-profile") == 0) {
+            line_profile = 1;
+        } else if (strcmp(argv[i], "--line-profile-out") == 0 && i + 1 < argc) {
+            line_profile      = 1;
+            line_profile_path = argv[++i];
+        } else if (strcmp(argv[i], "--trace-json") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--trace-threshold") == 0 && i + 1 < argc) {
+            trace_threshold_ns = strtoull(argv[++i], NULL, 10) * 1000ULL;
+        } else if (strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc) {
+            stats_path = argv[++i];
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed     = strtoul(argv[++i], NULL, 10);
+            seed_set = 1;
+        } else if (strcmp(argv[i], "--max-steps") == 0 && i + 1 < argc) {
+            max_steps = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--max-heap") == 0 && i + 1 < argc) {
+            max_heap = parse_size(argv[++i]);
+        } else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+            max_time_ns = strtod(argv[++i], NULL) * 1e9;
+        } else if (strcmp(argv[i], "--heap-census") == 0) {
+            heap_census = 1;
+        } else if (strcmp(argv[i], "--alloc-stats") == 0) {
+            alloc_stats = 1;
+        } else if (strcmp(argv[i], "--sample-out") == 0 && i + 1 < argc) {
+            sample_path = argv[++i];
+        } else if (argv[i][0] == '-' || path != NULL) {
+            ERROR(USAGE, argv[0]);
+        } else {
+            path = argv[i];
+        }
+    }
 
-    if (argc != 2) {
-        ERROR("USAGE: %s FILE\n", argv[0]);
+    if (path == NULL) {
+        ERROR(USAGE, argv[0]);
     }
 
-    if (!(cursor = mmap_file(argv[1]))) {
-        ERROR("unable to open '%s'\n", argv[1]);
+    if (!(cursor = source = mmap_file(path, &source_size))) {
+        ERROR("unable to open '%s'\n", path);
     }
 
-    srand(time(NULL));
+    source_path = path;
+    line_start  = source;
+
+    srand(seed_set ? seed : time(NULL));
+
+    output_is_tty = isatty(1);
+    atexit(output_flush);
+
+    flight_init();
+
+    if (trace_path != NULL) { trace_init(); }
+    if (stats_path != NULL) { atexit(stats_report); }
+
+    budget_init();
+
+    if (alloc_stats) { alloc_stats_init(); }
+    if (heap_census) { heap_census_init(); }
 
     /* Set up data structures. */
-    functions = hash_table_make_e(fn_name_t, array_t, str_hash, str_equ);
+    functions = hash_table_make_incremental(fn_name_t, Function, str_hash, str_equ);
     args      = array_make(array_t);
     program   = make_node(PROGRAM);
+    fn_infos  = array_make(FnInfo*);
+    locs      = array_make(SrcLoc);
+
+    /* Position 0 means "unknown". */
+    memset(&loc, 0, sizeof(loc));
+    array_push(locs, loc);
+
+    if (profile)   { prof_init();   }
+    if (sample_hz) { sample_init(); }
 
     /* Parse the whole file. */
+    NK_PROBE0(parse__start);
+    if (trace) { trace_begin("parse", 0); }
+    stats.source_bytes = source_size;
+    stats.parse_ns     = now_ns();
     while ((node = parse_node()).kind != INVALID) {
-        array_push(program.children, node);
+        NODES(push)(&program.children, &node);
     }
+    stats.parse_ns = now_ns() - stats.parse_ns;
+    if (trace) { trace_end("parse", 0); }
+    NK_PROBE1(parse__done, array_len(program.children));
+
+    /* The parsed nodes hold copies of everything they need. */
+    munmap((void*)source, source_size);
+
+    if (line_profile) { lprof_init(line); }
 
     /* Go! */
+    current_site = "<toplevel>";
+    stats.eval_start_ns = now_ns();
     interpret(&program);
+    stats.eval_ns = now_ns() - stats.eval_start_ns;
+
+    free_node(&program);
 
     return 0;
 }
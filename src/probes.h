@@ -0,0 +1,77 @@
+/*
+ * probes.h
+ *
+ * USDT (statically defined tracing) probes for the Nickel interpreter.
+ *
+ * Each probe compiles to a single nop plus an ELF note describing where it
+ * is and where its arguments live, so they cost next to nothing until a
+ * tool such as bpftrace or `perf probe` attaches to them:
+ *
+ *     bpftrace -e 'usdt:./nickel:nickel:function__entry { @[str(arg0)] = count(); }'
+ *
+ * We use <sys/sdt.h> when it is available. Otherwise, on x86-64 with a GNU
+ * compiler, we emit the same .note.stapsdt notes ourselves. Define
+ * NICKEL_NO_PROBES to compile them out entirely.
+ */
+
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+#if defined(NICKEL_NO_PROBES)
+
+#define NK_PROBE0(name)
+#define NK_PROBE1(name, a)
+#define NK_PROBE2(name, a, b)
+
+#elif defined(__has_include) && __has_include(<sys/sdt.h>)
+
+#include <sys/sdt.h>
+
+#define NK_PROBE0(name)       DTRACE_PROBE(nickel, name)
+#define NK_PROBE1(name, a)    DTRACE_PROBE1(nickel, name, a)
+#define NK_PROBE2(name, a, b) DTRACE_PROBE2(nickel, name, a, b)
+
+#elif defined(__x86_64__) && defined(__GNUC__)
+
+/* See https://sourceware.org/systemtap/wiki/UserSpaceProbeImplementation
+ * for the layout of the note. Every argument is passed as a signed 64-bit
+ * value in a register. */
+#define _NK_SDT(name, args, ...)                                                \
+    __asm__ __volatile__ (                                                      \
+        "990: nop\n"                                                            \
+        ".pushsection .note.stapsdt, \"?\", \"note\"\n"                         \
+        ".balign 4\n"                                                           \
+        ".4byte 992f-991f, 994f-993f, 3\n"                                      \
+        "991: .asciz \"stapsdt\"\n"                                             \
+        "992: .balign 4\n"                                                      \
+        "993: .8byte 990b\n"                                                    \
+        ".8byte _.stapsdt.base\n"                                               \
+        ".8byte 0\n"                                                            \
+        ".asciz \"nickel\"\n"                                                   \
+        ".asciz \"" #name "\"\n"                                                \
+        ".asciz \"" args "\"\n"                                                 \
+        "994: .balign 4\n"                                                      \
+        ".popsection\n"                                                         \
+        ".ifndef _.stapsdt.base\n"                                              \
+        ".pushsection .stapsdt.base, \"aG\", \"progbits\", .stapsdt.base, comdat\n" \
+        ".weak _.stapsdt.base\n"                                                \
+        ".hidden _.stapsdt.base\n"                                              \
+        "_.stapsdt.base: .space 1\n"                                            \
+        ".size _.stapsdt.base, 1\n"                                             \
+        ".popsection\n"                                                         \
+        ".endif\n"                                                              \
+        :: __VA_ARGS__)
+
+#define NK_PROBE0(name)       _NK_SDT(name, "", "i"(0))
+#define NK_PROBE1(name, a)    _NK_SDT(name, "-8@%0", "r"((long long)(a)))
+#define NK_PROBE2(name, a, b) _NK_SDT(name, "-8@%0 -8@%1", "r"((long long)(a)), "r"((long long)(b)))
+
+#else
+
+#define NK_PROBE0(name)
+#define NK_PROBE1(name, a)
+#define NK_PROBE2(name, a, b)
+
+#endif
+
+#endif
@@ -0,0 +1,389 @@
+/*
+ * simd.h
+ *
+ * Scanning kernels for the parser and the string hash, with SSE4.2, AVX2
+ * and AVX-512 versions picked at startup from what the CPU supports. This
+ * lets a portable build use the wide paths without -march=native.
+ *
+ * simd_init() must run before anything else calls into the kernels. It
+ * reads the NICKEL_SIMD environment variable, which can be set to
+ * "scalar", "sse4.2", "avx2" or "avx512" to force a lower level, e.g. to
+ * compare or test the paths on one machine.
+ *
+ * The vector kernels only use aligned loads, so they may read before the
+ * start or past the end of the string they are given, but never into
+ * another page. Every kernel stops at a zero byte. AddressSanitizer can't
+ * tell such reads from real overflows, so the kernels aren't instrumented,
+ * and an ASan build starts at the scalar level unless NICKEL_SIMD asks for
+ * another one.
+ */
+
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+enum {
+    SIMD_SCALAR,
+    SIMD_SSE42,
+    SIMD_AVX2,
+    SIMD_AVX512,
+    N_SIMD_LEVELS,
+};
+
+static const char *simd_level_names[] = {
+    "scalar", "sse4.2", "avx2", "avx512",
+};
+
+typedef struct {
+    int level;
+
+    /* Skip whitespace starting at p. Adds the newlines skipped to *lines
+       and points *line_start just past the last of them. */
+    const char *(*skip_space)(const char *p, unsigned *lines, const char **line_start);
+    /* The first '\n' or zero byte at or after p. */
+    const char *(*find_newline)(const char *p);
+    /* The first '"' or zero byte at or after p. */
+    const char *(*find_quote)(const char *p);
+    /* The first whitespace, ']' or zero byte at or after p. */
+    const char *(*find_name_end)(const char *p);
+    /* Count the newlines in [p, p + n) and point *line_start past the last
+       one, if any. */
+    unsigned (*count_newlines)(const char *p, size_t n, const char **line_start);
+} SimdKernels;
+
+static SimdKernels simd;
+
+
+/*** Scalar ***/
+
+static inline int simd_is_space(char c) {
+    return c == ' ' || (unsigned char)(c - '\t') <= '\r' - '\t';
+}
+
+static const char *scalar_skip_space(const char *p, unsigned *lines, const char **line_start) {
+    while (simd_is_space(*p)) {
+        if (*p == '\n') { *lines += 1; *line_start = p + 1; }
+        p += 1;
+    }
+    return p;
+}
+
+static const char *scalar_find_newline(const char *p) {
+    while (*p && *p != '\n') { p += 1; }
+    return p;
+}
+
+static const char *scalar_find_quote(const char *p) {
+    while (*p && *p != '"') { p += 1; }
+    return p;
+}
+
+static const char *scalar_find_name_end(const char *p) {
+    while (*p && !simd_is_space(*p) && *p != ']') { p += 1; }
+    return p;
+}
+
+static unsigned scalar_count_newlines(const char *p, size_t n, const char **line_start) {
+    unsigned count;
+    size_t   i;
+
+    count = 0;
+    for (i = 0; i < n; i += 1) {
+        if (p[i] == '\n') { count += 1; *line_start = p + i + 1; }
+    }
+    return count;
+}
+
+static uint64_t scalar_str_hash(const char *s) {
+    uint64_t hash = 5381;
+    int c;
+
+    while ((c = *s++))
+        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+
+    return hash;
+}
+
+
+/*** Vector kernels ***/
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+#include <immintrin.h>
+
+#define SIMD_NO_ASAN __attribute__((no_sanitize_address))
+
+/* A word that may alias the chars it is loaded from. */
+typedef uint64_t __attribute__((may_alias)) simd_word_t;
+
+/* CRC32C consumes its input a byte at a time, so feeding it whole words
+   where we can gives the same result for a string at any alignment. */
+__attribute__((target("sse4.2"))) SIMD_NO_ASAN
+static uint64_t crc_str_hash(const char *s) {
+    const simd_word_t *w;
+    uint64_t           word;
+    uint64_t           zeros;
+    uint64_t           crc;
+    uint64_t           len;
+    unsigned           z;
+    unsigned           i;
+
+    crc = 5381;
+    len = 0;
+
+    for (; (uintptr_t)s & 7; s += 1, len += 1) {
+        if (*s == 0) { goto out; }
+        crc = _mm_crc32_u8(crc, *s);
+    }
+
+    for (w = (const simd_word_t*)s; ; w += 1, len += 8) {
+        word  = *w;
+        zeros = (word - 0x0101010101010101ULL) & ~word & 0x8080808080808080ULL;
+        if (zeros) {
+            z = __builtin_ctzll(zeros) / 8;
+            for (i = 0; i < z; i += 1) {
+                crc = _mm_crc32_u8(crc, word >> (i * 8));
+            }
+            len += z;
+            break;
+        }
+        crc = _mm_crc32_u64(crc, word);
+    }
+
+out:
+    return (crc ^ (len << 32)) * 0x9E3779B97F4A7C15ULL;
+}
+
+/* Each level provides, for the aligned block at p, a bitmask with a bit set
+   for every byte equal to c, and one for every whitespace byte. */
+
+#define SSE42_W (16)
+#define SSE42_TARGET "sse4.2"
+
+__attribute__((target("sse4.2"))) SIMD_NO_ASAN
+static inline uint64_t sse42_eq(const char *p, char c) {
+    __m128i v = _mm_load_si128((const __m128i*)p);
+    return (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+
+__attribute__((target("sse4.2"))) SIMD_NO_ASAN
+static inline uint64_t sse42_space(const char *p) {
+    __m128i v = _mm_load_si128((const __m128i*)p);
+    __m128i t = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8('\r' - '\t')), t),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+    return (uint16_t)_mm_movemask_epi8(m);
+}
+
+#define AVX2_W (32)
+#define AVX2_TARGET "avx2,sse4.2"
+
+__attribute__((target("avx2"))) SIMD_NO_ASAN
+static inline uint64_t avx2_eq(const char *p, char c) {
+    __m256i v = _mm256_load_si256((const __m256i*)p);
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)));
+}
+
+__attribute__((target("avx2"))) SIMD_NO_ASAN
+static inline uint64_t avx2_space(const char *p) {
+    __m256i v = _mm256_load_si256((const __m256i*)p);
+    __m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+    __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8('\r' - '\t')), t),
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+    return (uint32_t)_mm256_movemask_epi8(m);
+}
+
+#define AVX512_W (64)
+#define AVX512_TARGET "avx512f,avx512bw,sse4.2"
+
+__attribute__((target("avx512f,avx512bw"))) SIMD_NO_ASAN
+static inline uint64_t avx512_eq(const char *p, char c) {
+    __m512i v = _mm512_load_si512((const void*)p);
+    return _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(c));
+}
+
+__attribute__((target("avx512f,avx512bw"))) SIMD_NO_ASAN
+static inline uint64_t avx512_space(const char *p) {
+    __m512i v = _mm512_load_si512((const void*)p);
+    __m512i t = _mm512_sub_epi8(v, _mm512_set1_epi8('\t'));
+    return _mm512_cmple_epu8_mask(t, _mm512_set1_epi8('\r' - '\t'))
+         | _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(' '));
+}
+
+/* The bits of a W-byte block, and the bits below bit n. */
+#define SIMD_ALL(W)      ((W) == 64 ? ~0ULL : (1ULL << (W)) - 1)
+#define SIMD_BELOW(n)    ((n) >= 64 ? ~0ULL : (1ULL << (n)) - 1)
+
+/* Instantiate the kernels for one level from its eq/space primitives. */
+#define use_simd_kernels(L, W, TARGET)                                                  \
+    __attribute__((target(TARGET))) SIMD_NO_ASAN                                        \
+    static const char *L##_skip_space(const char *p, unsigned *lines,                   \
+                                      const char **line_start) {                        \
+        const char *base;                                                               \
+        uint64_t    skip;                                                               \
+        uint64_t    stop;                                                               \
+        uint64_t    nl;                                                                 \
+        unsigned    at;                                                                 \
+                                                                                        \
+        base = (const char*)((uintptr_t)p & ~(uintptr_t)((W) - 1));                     \
+        skip = SIMD_BELOW(p - base);                                                    \
+        for (;;) {                                                                      \
+            stop = ~(L##_space(base) | skip) & SIMD_ALL(W);                             \
+            nl   = L##_eq(base, '\n') & ~skip;                                          \
+            at   = stop ? __builtin_ctzll(stop) : (W);                                  \
+            nl  &= SIMD_BELOW(at);                                                      \
+            if (nl) {                                                                   \
+                *lines      += __builtin_popcountll(nl);                                \
+                *line_start  = base + (63 - __builtin_clzll(nl)) + 1;                   \
+            }                                                                           \
+            if (stop) { return base + at; }                                             \
+            base += (W);                                                                \
+            skip  = 0;                                                                  \
+        }                                                                               \
+    }                                                                                   \
+                                                                                        \
+    __attribute__((target(TARGET))) SIMD_NO_ASAN                                        \
+    static const char *L##_find_newline(const char *p) {                                \
+        const char *base;                                                               \
+        uint64_t    skip;                                                               \
+        uint64_t    m;                                                                  \
+                                                                                        \
+        base = (const char*)((uintptr_t)p & ~(uintptr_t)((W) - 1));                     \
+        skip = SIMD_BELOW(p - base);                                                    \
+        for (;; base += (W), skip = 0) {                                                \
+            m = (L##_eq(base, '\n') | L##_eq(base, 0)) & ~skip;                         \
+            if (m) { return base + __builtin_ctzll(m); }                                \
+        }                                                                               \
+    }                                                                                   \
+                                                                                        \
+    __attribute__((target(TARGET))) SIMD_NO_ASAN                                        \
+    static const char *L##_find_quote(const char *p) {                                  \
+        const char *base;                                                               \
+        uint64_t    skip;                                                               \
+        uint64_t    m;                                                                  \
+                                                                                        \
+        base = (const char*)((uintptr_t)p & ~(uintptr_t)((W) - 1));                     \
+        skip = SIMD_BELOW(p - base);                                                    \
+        for (;; base += (W), skip = 0) {                                                \
+            m = (L##_eq(base, '"') | L##_eq(base, 0)) & ~skip;                          \
+            if (m) { return base + __builtin_ctzll(m); }                                \
+        }                                                                               \
+    }                                                                                   \
+                                                                                        \
+    __attribute__((target(TARGET))) SIMD_NO_ASAN                                        \
+    static const char *L##_find_name_end(const char *p) {                               \
+        const char *base;                                                               \
+        uint64_t    skip;                                                               \
+        uint64_t    m;                                                                  \
+                                                                                        \
+        base = (const char*)((uintptr_t)p & ~(uintptr_t)((W) - 1));                     \
+        skip = SIMD_BELOW(p - base);                                                    \
+        for (;; base += (W), skip = 0) {                                                \
+            m = (L##_space(base) | L##_eq(base, ']') | L##_eq(base, 0)) & ~skip;        \
+            if (m) { return base + __builtin_ctzll(m); }                                \
+        }                                                                               \
+    }                                                                                   \
+                                                                                        \
+    __attribute__((target(TARGET))) SIMD_NO_ASAN                                        \
+    static unsigned L##_count_newlines(const char *p, size_t n,                         \
+                                       const char **line_start) {                       \
+        const char *base;                                                               \
+        const char *end;                                                                \
+        uint64_t    skip;                                                               \
+        uint64_t    nl;                                                                 \
+        unsigned    count;                                                              \
+                                                                                        \
+        if (n == 0) { return 0; }                                                       \
+                                                                                        \
+        end   = p + n;                                                                  \
+        base  = (const char*)((uintptr_t)p & ~(uintptr_t)((W) - 1));                    \
+        skip  = SIMD_BELOW(p - base);                                                   \
+        count = 0;                                                                      \
+        for (; base < end; base += (W), skip = 0) {                                     \
+            nl = L##_eq(base, '\n') & ~skip;                                            \
+            if (end - base < (W)) { nl &= SIMD_BELOW(end - base); }                     \
+            if (nl) {                                                                   \
+                count       += __builtin_popcountll(nl);                                \
+                *line_start  = base + (63 - __builtin_clzll(nl)) + 1;                   \
+            }                                                                           \
+        }                                                                               \
+        return count;                                                                   \
+    }
+
+use_simd_kernels(sse42,  SSE42_W,  SSE42_TARGET)
+use_simd_kernels(avx2,   AVX2_W,   AVX2_TARGET)
+use_simd_kernels(avx512, AVX512_W, AVX512_TARGET)
+
+#define SIMD_KERNELS(L, LEVEL)                                                    \
+    ((SimdKernels){ (LEVEL), L##_skip_space, L##_find_newline, L##_find_quote,    \
+                    L##_find_name_end, L##_count_newlines })
+
+static int simd_detect(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) { return SIMD_AVX512; }
+    if (__builtin_cpu_supports("avx2"))     { return SIMD_AVX2;   }
+    if (__builtin_cpu_supports("sse4.2"))   { return SIMD_SSE42;  }
+    return SIMD_SCALAR;
+}
+
+#else
+
+static int simd_detect(void) { return SIMD_SCALAR; }
+
+#endif
+
+static void simd_init(void) {
+    const char *want;
+    int         detected;
+    int         level;
+    int         i;
+
+    detected = simd_detect();
+    level    = detected;
+#ifdef __SANITIZE_ADDRESS__
+    level    = SIMD_SCALAR;
+#endif
+
+    if ((want = getenv("NICKEL_SIMD")) != NULL) {
+        for (i = 0; i < N_SIMD_LEVELS; i += 1) {
+            if (strcmp(want, simd_level_names[i]) == 0) { break; }
+        }
+        if (i == N_SIMD_LEVELS) {
+            fprintf(stderr, "Nickel: unknown NICKEL_SIMD level '%s', using %s\n",
+                    want, simd_level_names[level]);
+        } else if (i > detected) {
+            fprintf(stderr, "Nickel: this CPU doesn't support %s, using %s\n",
+                    want, simd_level_names[level]);
+        } else {
+            level = i;
+        }
+    }
+
+    switch (level) {
+#if defined(__x86_64__) && defined(__GNUC__)
+        case SIMD_AVX512: simd = SIMD_KERNELS(avx512, SIMD_AVX512); break;
+        case SIMD_AVX2:   simd = SIMD_KERNELS(avx2,   SIMD_AVX2);   break;
+        case SIMD_SSE42:  simd = SIMD_KERNELS(sse42,  SIMD_SSE42);  break;
+#endif
+        default:
+            simd = (SimdKernels){ SIMD_SCALAR, scalar_skip_space, scalar_find_newline,
+                                  scalar_find_quote, scalar_find_name_end,
+                                  scalar_count_newlines };
+    }
+}
+
+/* Hash a string. Unlike the scanning kernels this isn't called through
+   `simd`: the hash tables call it on every lookup, and a branch on the
+   level predicts perfectly where an indirect call can't be inlined. */
+static inline uint64_t simd_str_hash(const char *s) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (simd.level >= SIMD_SSE42) { return crc_str_hash(s); }
+#endif
+    return scalar_str_hash(s);
+}
+
+#endif